@@ -0,0 +1,219 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// The configuration file consists of lines "key = value". Empty lines and
+// lines starting with '#' are ignored.
+
+#include "config.h"
+#include "writer.h"
+#include <assert.h> // assert()
+#include <ctype.h> // isspace()
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h> // fopen(), fgets(), fprintf()
+#include <stdlib.h> // strtoul()
+#include <string.h>
+
+void
+config_set_defaults(struct config *config)
+{
+	assert(config);
+
+	*config = (struct config) {
+		.serial_device = "/dev/ttyAMA0",
+		.serial_adaptive = true,
+		.storage = STORAGE_POSTGRESQL,
+		.db_conninfo = "user=stromzähler dbname=stromzähler",
+		.file_dir = "/var/lib/stromzaehler",
+		.line_socket = "",
+		.batch_size = 10,
+		.flush_interval = 10,
+		.stats_interval = 3600,
+		.log_level = LOG_INFO,
+		.control_socket = "",
+		.tariff_file = "",
+		.state_file = "",
+	};
+}
+
+static bool
+parse_string(char *dest, size_t len, const char *value)
+{
+	if (strlen(value) >= len) {
+		return false;
+	}
+	strcpy(dest, value);
+	return true;
+}
+
+static bool
+parse_ulong(unsigned long *dest, const char *value, unsigned long min,
+		unsigned long max)
+{
+	char *end = NULL;
+	errno = 0;
+	unsigned long n = strtoul(value, &end, 10);
+	if (end == value || *end != '\0' || errno != 0 || n < min || n > max) {
+		return false;
+	}
+	*dest = n;
+	return true;
+}
+
+static bool
+parse_bool(bool *dest, const char *value)
+{
+	if (strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 ||
+			strcmp(value, "1") == 0) {
+		*dest = true;
+	} else if (strcmp(value, "no") == 0 || strcmp(value, "false") == 0 ||
+			strcmp(value, "0") == 0) {
+		*dest = false;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static bool
+parse_enum(int *dest, const char *value, const char *const names[],
+		unsigned count)
+{
+	for (unsigned i = 0; i < count; i++) {
+		if (strcmp(value, names[i]) == 0) {
+			*dest = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Sets one setting. Returns false if the key is unknown or the value invalid,
+// in which case config is unchanged.
+bool
+config_set(struct config *config, const char *key, const char *value)
+{
+	assert(config);
+	assert(key);
+	assert(value);
+
+	static const char *const storages[] = {"postgresql", "file", "line"};
+	static const char *const log_levels[] = {"error", "info", "debug"};
+
+	unsigned long n;
+	int e;
+	bool ok = false;
+
+	if (strcmp(key, "serial_device") == 0) {
+		ok = parse_string(config->serial_device,
+			sizeof(config->serial_device), value);
+	} else if (strcmp(key, "serial_adaptive") == 0) {
+		ok = parse_bool(&config->serial_adaptive, value);
+	} else if (strcmp(key, "storage") == 0) {
+		ok = parse_enum(&e, value, storages, 3);
+		if (ok) {
+			config->storage = e;
+		}
+	} else if (strcmp(key, "db_conninfo") == 0) {
+		ok = parse_string(config->db_conninfo,
+			sizeof(config->db_conninfo), value);
+	} else if (strcmp(key, "file_dir") == 0) {
+		ok = parse_string(config->file_dir, sizeof(config->file_dir),
+			value);
+	} else if (strcmp(key, "line_socket") == 0) {
+		ok = parse_string(config->line_socket,
+			sizeof(config->line_socket), value);
+	} else if (strcmp(key, "batch_size") == 0) {
+		ok = parse_ulong(&n, value, 1, WRITER_BATCH_MAX);
+		if (ok) {
+			config->batch_size = n;
+		}
+	} else if (strcmp(key, "flush_interval") == 0) {
+		ok = parse_ulong(&n, value, 1, 24 * 60 * 60);
+		if (ok) {
+			config->flush_interval = n;
+		}
+	} else if (strcmp(key, "stats_interval") == 0) {
+		ok = parse_ulong(&config->stats_interval, value, 1, ULONG_MAX);
+	} else if (strcmp(key, "log_level") == 0) {
+		ok = parse_enum(&e, value, log_levels, 3);
+		if (ok) {
+			config->log_level = e;
+		}
+	} else if (strcmp(key, "control_socket") == 0) {
+		ok = parse_string(config->control_socket,
+			sizeof(config->control_socket), value);
+	} else if (strcmp(key, "tariff_file") == 0) {
+		ok = parse_string(config->tariff_file,
+			sizeof(config->tariff_file), value);
+	} else if (strcmp(key, "state_file") == 0) {
+		ok = parse_string(config->state_file,
+			sizeof(config->state_file), value);
+	}
+
+	return ok;
+}
+
+static char *
+trim(char *s)
+{
+	while (isspace((unsigned char) *s)) {
+		s++;
+	}
+	char *end = s + strlen(s);
+	while (end > s && isspace((unsigned char) end[-1])) {
+		end--;
+	}
+	*end = '\0';
+	return s;
+}
+
+// Reads the settings of the file into config. Settings which are missing in
+// the file keep their value. Returns false if the file can't be read or
+// contains an invalid line; config may be partially modified in this case.
+bool
+config_load(struct config *config, const char *path)
+{
+	assert(config);
+	assert(path);
+
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Error: Opening %s failed (%s)\n",
+			path, strerror(errno));
+		return false;
+	}
+
+	bool ok = true;
+	char line[CONFIG_STRING_LEN + PATH_MAX];
+	unsigned line_nr = 0;
+	while (fgets(line, sizeof(line), file)) {
+		line_nr++;
+		char *key = trim(line);
+		if (*key == '\0' || *key == '#') {
+			continue;
+		}
+
+		char *value = strchr(key, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Error: %s:%u: missing '='\n", path, line_nr);
+			ok = false;
+			continue;
+		}
+		*value = '\0';
+		key = trim(key);
+		value = trim(value + 1);
+
+		if (!config_set(config, key, value)) {
+			fprintf(stderr, "Error: %s:%u: invalid setting %s = %s\n",
+				path, line_nr, key, value);
+			ok = false;
+		}
+	}
+
+	if (ferror(file)) {
+		fprintf(stderr, "Error: Reading %s failed\n", path);
+		ok = false;
+	}
+	fclose(file);
+	return ok;
+}
@@ -0,0 +1,56 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <limits.h> // PATH_MAX
+#include <stdbool.h>
+#include <time.h>
+
+#define CONFIG_DEFAULT_PATH "/etc/stromzaehler.conf"
+#define CONFIG_STRING_LEN 256
+
+enum storage {
+	STORAGE_POSTGRESQL,
+	STORAGE_FILE, // append-only columnar files in file_dir
+	STORAGE_LINE, // line protocol on stdout or line_socket
+};
+
+enum log_level {
+	LOG_ERROR, // only errors
+	LOG_INFO, // additionally the statistics
+	LOG_DEBUG, // additionally every detected load change
+};
+
+// All settings are stored in fixed size arrays, so a config can be copied as a
+// whole and swapped atomically
+struct config {
+	char serial_device[PATH_MAX];
+	bool serial_adaptive;
+
+	enum storage storage;
+	char db_conninfo[CONFIG_STRING_LEN];
+	char file_dir[PATH_MAX];
+	char line_socket[PATH_MAX]; // empty = stdout
+
+	// Measurements are passed to the storage backend in batches of this size
+	// (at most WRITER_BATCH_MAX), but at least every flush_interval seconds
+	unsigned batch_size;
+	time_t flush_interval;
+
+	// print statistics after this number of frames
+	unsigned long stats_interval;
+	enum log_level log_level;
+
+	char control_socket[PATH_MAX]; // empty = disabled
+
+	char tariff_file[PATH_MAX]; // empty = costs are not calculated
+
+	char state_file[PATH_MAX]; // empty = the state isn't saved
+};
+
+void config_set_defaults(struct config *config);
+bool config_set(struct config *config, const char *key, const char *value);
+bool config_load(struct config *config, const char *path);
+
+#endif
@@ -0,0 +1,192 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#include "control.h"
+#include <assert.h> // assert()
+#include <errno.h>
+#include <fcntl.h> // fcntl()
+#include <poll.h> // poll()
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h> // fprintf(), vsnprintf()
+#include <stdlib.h> // free()
+#include <string.h>
+#include <sys/socket.h> // socket(), bind(), listen(), accept(), recv(), send()
+#include <sys/un.h> // struct sockaddr_un
+#include <time.h> // clock_gettime()
+#include <unistd.h> // close(), unlink()
+
+// A client has to send its commands within this time (in ms), since frames
+// of the meter are not read while a client is served. The kernel buffers the
+// serial input meanwhile, so no frame is lost.
+#define CONTROL_TIMEOUT 500
+#define LINE_LEN 512
+
+// Opens a listening socket at path. An empty path disables the control socket.
+bool
+control_open(struct control *control, const char *path)
+{
+	assert(control);
+	assert(path);
+
+	control->fd = -1;
+	control->path = NULL;
+
+	if (*path == '\0') {
+		return true;
+	}
+
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: Socket path %s too long\n", path);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	control->path = strdup(path);
+	if (control->path == NULL) {
+		fprintf(stderr, "Error: strdup() failed (%s)\n", strerror(errno));
+		return false;
+	}
+
+	control->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (control->fd < 0) {
+		fprintf(stderr, "Error: socket() failed (%s)\n", strerror(errno));
+		control_close(control);
+		return false;
+	}
+
+	// remove the socket of a previous run
+	unlink(path);
+
+	if (bind(control->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			listen(control->fd, 4) < 0) {
+		fprintf(stderr, "Error: Listening on %s failed (%s)\n",
+			path, strerror(errno));
+		control_close(control);
+		return false;
+	}
+
+	return true;
+}
+
+void
+control_close(struct control *control)
+{
+	assert(control);
+
+	if (control->fd >= 0) {
+		close(control->fd);
+		unlink(control->path);
+	}
+	free(control->path);
+	control->fd = -1;
+	control->path = NULL;
+}
+
+void
+control_reply(int client, const char *format, ...)
+{
+	char buf[LINE_LEN];
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+
+	if (len < 0) {
+		return;
+	}
+	if ((size_t) len >= sizeof(buf)) {
+		len = sizeof(buf) - 1;
+	}
+	// errors are ignored, the client may already be gone
+	send(client, buf, len, MSG_NOSIGNAL);
+}
+
+static void
+serve_client(int client, control_handler handler, void *ctx)
+{
+	char buf[LINE_LEN];
+	size_t len = 0;
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (true) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long timeout = CONTROL_TIMEOUT
+			- (now.tv_sec - start.tv_sec) * 1000
+			- (now.tv_nsec - start.tv_nsec) / 1000000;
+		if (timeout <= 0) {
+			break;
+		}
+
+		struct pollfd pfd = {.fd = client, .events = POLLIN};
+		if (poll(&pfd, 1, timeout) <= 0) {
+			break;
+		}
+
+		ssize_t n = recv(client, buf + len, sizeof(buf) - 1 - len, 0);
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+		buf[len] = '\0';
+
+		char *line = buf;
+		char *newline;
+		while ((newline = strchr(line, '\n')) != NULL) {
+			*newline = '\0';
+			handler(ctx, client, line);
+			line = newline + 1;
+		}
+
+		len = strlen(line);
+		memmove(buf, line, len + 1);
+		if (len == sizeof(buf) - 1) {
+			control_reply(client, "error: line too long\n");
+			len = 0;
+		}
+	}
+
+	// a last line without newline
+	if (len > 0) {
+		handler(ctx, client, buf);
+	}
+	handler(ctx, client, NULL);
+}
+
+// Serves all clients which are waiting for a connection. Returns immediately if
+// there are none.
+void
+control_serve(struct control *control, control_handler handler, void *ctx)
+{
+	assert(control);
+	assert(handler);
+
+	if (control->fd < 0) {
+		return;
+	}
+
+	while (true) {
+		int client = accept(control->fd, NULL, NULL);
+		if (client < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR) {
+				fprintf(stderr, "Error: accept() failed (%s)\n",
+					strerror(errno));
+			}
+			return;
+		}
+
+		// accepted sockets don't inherit O_NONBLOCK on Linux, but be sure
+		int flags = fcntl(client, F_GETFL);
+		if (flags >= 0) {
+			fcntl(client, F_SETFL, flags & ~O_NONBLOCK);
+		}
+
+		serve_client(client, handler, ctx);
+		close(client);
+	}
+}
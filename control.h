@@ -0,0 +1,26 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdbool.h>
+
+// Unix stream socket to control the running program. Clients send commands
+// as lines of text.
+struct control {
+	int fd; // -1 if disabled
+	char *path;
+};
+
+// Called for every received line and with line = NULL after the client closed
+// the connection. Replies can be written to client.
+typedef void (*control_handler)(void *ctx, int client, char *line);
+
+bool control_open(struct control *control, const char *path);
+void control_close(struct control *control);
+void control_serve(struct control *control, control_handler handler,
+		void *ctx);
+void control_reply(int client, const char *format, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+#endif
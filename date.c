@@ -6,7 +6,7 @@
 #include <stdbool.h> // Datentyp bool
 #include <stdio.h> //fprintf()
 #include <string.h> //strerror()
-#include <time.h> //time(), localtime()
+#include <time.h> //time(), localtime_r()
 
 
 void
@@ -15,14 +15,17 @@ time_to_date(struct date *date, time_t time)
 	assert(date);
 	assert(time >= (time_t) 0);
 
-	struct tm *tm = localtime(&time);
-	assert(tm);
+	// Unlike localtime(), localtime_r() doesn't reload the time zone on
+	// every call, which allocates memory if TZ isn't set
+	struct tm tm;
+	struct tm *result = localtime_r(&time, &tm);
+	assert(result);
 
-	date->day = tm->tm_mday;
+	date->day = tm.tm_mday;
 	// tm_mon stores the month as 0-11 (January = 0)
-	date->month = tm->tm_mon + 1;
+	date->month = tm.tm_mon + 1;
 	// tm_year stores the year as an offset of the year 1900
-	date->year = tm->tm_year + 1900;
+	date->year = tm.tm_year + 1900;
 }
 
 void
@@ -0,0 +1,96 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#include "events.h"
+#include <assert.h> // assert()
+#include <math.h> // fabs()
+#include <stdbool.h>
+#include <string.h> // memset()
+
+// Minimal change of the power of a phase that is reported as an event
+#define EVENT_THRESHOLD 50.0 // W
+
+// Number of consecutive samples at the new level before a change is reported.
+// This suppresses short spikes, e.g. the inrush current of a motor.
+#define EVENT_SETTLE 3
+
+// Weight of a new sample in the moving average of a steady state
+#define LEVEL_ALPHA 0.1
+
+void
+event_detector_init(struct event_detector *ed)
+{
+	assert(ed);
+	memset(ed, 0, sizeof(*ed));
+}
+
+// Returns true if the sample completes a step change. In this case the
+// difference to the previous level is stored in delta.
+static bool
+step_detector_update(struct step_detector *sd, double power,
+		const struct timespec *timestamp, double *delta)
+{
+	assert(sd);
+	assert(timestamp);
+	assert(delta);
+
+	if (!sd->initialized) {
+		sd->level = power;
+		sd->count = 0;
+		sd->initialized = true;
+		return false;
+	}
+
+	if (fabs(power - sd->level) < EVENT_THRESHOLD) {
+		// the steady state continues, follow slow drifts
+		sd->level += LEVEL_ALPHA * (power - sd->level);
+		sd->count = 0;
+		return false;
+	}
+
+	if (sd->count > 0 && fabs(power - sd->candidate) < EVENT_THRESHOLD) {
+		sd->count++;
+		sd->candidate += (power - sd->candidate) / sd->count;
+	} else {
+		sd->candidate = power;
+		sd->count = 1;
+		sd->start = *timestamp;
+	}
+
+	if (sd->count < EVENT_SETTLE) {
+		return false;
+	}
+
+	*delta = sd->candidate - sd->level;
+	sd->level = sd->candidate;
+	sd->count = 0;
+	return true;
+}
+
+// Feeds the power of each phase of the measurement into its step detector.
+// Returns the number of detected events, which are stored in events.
+unsigned
+event_detector_update(struct event_detector *ed, const struct measurement *m,
+		struct event events[PHASES])
+{
+	assert(ed);
+	assert(m);
+	assert(events);
+
+	const double power[PHASES] = {m->powerL1, m->powerL2, m->powerL3};
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < PHASES; i++) {
+		double delta;
+		if (step_detector_update(&ed->phases[i], power[i],
+				&m->timestamp, &delta)) {
+			// the step happened with the first sample at the new level
+			events[n].timestamp = ed->phases[i].start;
+			events[n].phase = i + 1;
+			events[n].delta = delta;
+			events[n].power = ed->phases[i].level;
+			n++;
+		}
+	}
+
+	return n;
+}
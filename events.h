@@ -0,0 +1,37 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include "smlReader.h"
+#include <stdbool.h>
+#include <time.h>
+
+#define PHASES 3
+
+// A step change of the power of one phase, e.g. an appliance switched on
+// (delta > 0) or off (delta < 0)
+struct event {
+	struct timespec timestamp;
+	unsigned phase; // 1-3
+	double delta; // W
+	double power; // W, power of the phase after the change
+};
+
+struct step_detector {
+	bool initialized;
+	double level; // W, power of the current steady state
+	double candidate; // W, mean of the samples deviating from level
+	unsigned count; // number of consecutive samples deviating from level
+	struct timespec start; // time of the first sample deviating from level
+};
+
+struct event_detector {
+	struct step_detector phases[PHASES];
+};
+
+void event_detector_init(struct event_detector *ed);
+unsigned event_detector_update(struct event_detector *ed,
+		const struct measurement *m, struct event events[PHASES]);
+
+#endif
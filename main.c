@@ -1,20 +1,35 @@
 // Copyright © 2021 Maximilian Wenzkowski
 
+#include "config.h"
+#include "control.h"
 #include "date.h"
+#include "events.h"
+#include "memory.h"
 #include "smlReader.h"
+#include "state.h"
+#include "tariff.h"
+#include "validate.h"
+#include "writer.h"
 #include <assert.h> // assert()
-#include <errno.h>
-#include <libpq-fe.h>
 #include <math.h> // lround()
+#include <signal.h> // sigaction()
 #include <stdbool.h> //Für die Werte true und false
-#include <stdio.h> // snprintf(), fprintf()
+#include <stdio.h> // fprintf(), dprintf()
 #include <stdlib.h> // exit()
-#include <time.h> // time()
-#include <unistd.h> // sleep()
+#include <string.h> // strcmp(), strtok_r()
+#include <time.h> // time(), clock_gettime()
+#include <unistd.h> // access(), STDERR_FILENO
 
 
-const char SERIAL_DEV[] = "/dev/ttyAMA0";
-const int QUERY_BUF_LEN = 512;
+// Set by the signal handler of SIGHUP to reload the configuration file
+static volatile sig_atomic_t reload_requested = 0;
+
+// Set by the signal handler of SIGTERM and SIGINT to stop the program
+static volatile sig_atomic_t stop_requested = 0;
+
+// The running costs and the state of the event detector of the last run are
+// only continued after an interruption of at most this duration
+const time_t STATE_MAX_AGE = 15 * 60; // s
 
 struct counter_cache {
 	bool empty;
@@ -39,29 +54,82 @@ counter_cache_clear(struct counter_cache *cache)
 	cache->empty = true;
 }
 
+struct writer_stats {
+	unsigned long rows, flushes;
+	double time; // s spent in write() and flush() of the storage backend
+};
+
+// After this number of frames the program must not allocate heap memory for
+// a frame anymore, apart from libraries like libpq
+const unsigned long STEADY_STATE_FRAMES = 60;
+
+// The self-check changes the power after this number of frames
+const unsigned EVENT_CHECK_FRAMES = 8;
+
+struct validation_stats {
+	unsigned long checked;
+	unsigned long quarantined[VALIDATION_RESULTS]; // by reason
+};
+
+struct memory_stats {
+	unsigned long frames;
+	unsigned long allocations; // heap allocations while processing frames
+	unsigned long library_allocations; // made by libpq in addition
+	bool warned; // a steady state violation was reported
+};
+
 
 struct stromzaehler {
-	PGconn *dbConn;
+	const char *config_path; // NULL if no configuration file is used
+	struct config config;
+	struct control control;
+
+	struct writer *writer;
 	smlReader_t *smlReader;
 
+	struct validator validator;
 	struct counter_cache counter_cache;
+	struct event_detector event_detector;
 
 	struct date current_date;
 
 	bool hasCounterAtStartOfDay;
 	double counterAtStartOfDay;
+
+	bool has_tariff;
+	struct tariff tariff;
+	struct cost_accumulator costs;
+
+	struct measurement batch[WRITER_BATCH_MAX];
+	unsigned batch_len;
+	time_t last_flush;
+
+	struct writer_stats writer_stats;
+	struct validation_stats validation_stats;
+	struct memory_stats memory_stats;
+
+	struct state state;
+	struct timespec last_committed; // last measurement passed to the backend
 };
 
 
 void
-error_exit(struct stromzaehler *stromzaehler)
+stromzaehler_close(struct stromzaehler *stromzaehler)
 {
-	if (stromzaehler->dbConn) {
-		PQfinish(stromzaehler->dbConn);
+	if (stromzaehler->writer) {
+		stromzaehler->writer->ops->close(stromzaehler->writer);
 	}
 	if (stromzaehler->smlReader) {
 		smlReader_close(stromzaehler->smlReader);
 	}
+	control_close(&stromzaehler->control);
+	state_close(&stromzaehler->state);
+}
+
+void
+error_exit(struct stromzaehler *stromzaehler)
+{
+	stromzaehler_close(stromzaehler);
 	exit(EXIT_FAILURE);
 }
 
@@ -70,7 +138,9 @@ stromzaehler_create_SmlReader(struct stromzaehler *stromzaehler)
 {
 	assert(stromzaehler);
 
-	stromzaehler->smlReader = smlReader_create(SERIAL_DEV);
+	stromzaehler->smlReader = smlReader_create(
+		stromzaehler->config.serial_device,
+		stromzaehler->config.serial_adaptive);
 	if (stromzaehler->smlReader == NULL) {
 		// smlReader_create() has printed an error message, therefore we don't
 		// need to print one
@@ -78,92 +148,194 @@ stromzaehler_create_SmlReader(struct stromzaehler *stromzaehler)
 	}
 }
 
+// Returns NULL on error, the backend has printed an error message then
+struct writer *
+create_writer(const struct config *config)
+{
+	assert(config);
+
+	switch (config->storage) {
+	case STORAGE_POSTGRESQL:
+		return writer_pg_create(config->db_conninfo);
+	case STORAGE_FILE:
+		return writer_file_create(config->file_dir);
+	case STORAGE_LINE:
+		return writer_line_create(*config->line_socket ?
+			config->line_socket : NULL);
+	}
+	return NULL;
+}
+
 void
-stromzaehler_connect_to_db(struct stromzaehler *stromzaehler)
+stromzaehler_create_writer(struct stromzaehler *stromzaehler)
 {
 	assert(stromzaehler);
 
-	stromzaehler->dbConn = PQconnectdb("user=stromzähler dbname=stromzähler");
-	if (stromzaehler->dbConn == NULL) {
-		fprintf(stderr, "PQconnectdb() failed");
+	stromzaehler->writer = create_writer(&stromzaehler->config);
+	if (stromzaehler->writer == NULL) {
 		error_exit(stromzaehler);
 	}
-	if (PQstatus(stromzaehler->dbConn) == CONNECTION_BAD) {
-		fprintf(stderr, "Connection to database failed: %s\n",
-			PQerrorMessage(stromzaehler->dbConn));
+}
+
+static double
+elapsed(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double) (now.tv_sec - start->tv_sec) +
+		(double) (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Passes the batched measurements to the storage backend and flushes it
+void
+stromzaehler_flush(struct stromzaehler *stromzaehler)
+{
+	assert(stromzaehler);
+	assert(stromzaehler->writer);
+
+	struct writer *writer = stromzaehler->writer;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (!writer->ops->write(writer, stromzaehler->batch,
+			stromzaehler->batch_len)) {
 		error_exit(stromzaehler);
 	}
+	if (!writer->ops->flush(writer)) {
+		error_exit(stromzaehler);
+	}
+
+	stromzaehler->writer_stats.time += elapsed(&start);
+	stromzaehler->writer_stats.rows += stromzaehler->batch_len;
+	stromzaehler->writer_stats.flushes++;
+
+	if (stromzaehler->batch_len > 0) {
+		stromzaehler->last_committed = stromzaehler->batch[
+			stromzaehler->batch_len - 1].timestamp;
+	}
+	stromzaehler->batch_len = 0;
+	stromzaehler->last_flush = time(NULL);
 }
 
 void
-stromzaehler_get_counterAtStartOfDay_from_db(struct stromzaehler *stromzaehler)
+stromzaehler_get_counterAtStartOfDay(struct stromzaehler *stromzaehler)
 {
 	assert(stromzaehler);
-	assert(stromzaehler->dbConn);
+	assert(stromzaehler->writer);
 
 	stromzaehler->hasCounterAtStartOfDay = false;
 
-	char query_buf[QUERY_BUF_LEN];
-	PGresult *res = NULL;
-
-	struct date *current = &stromzaehler->current_date;
-	struct date prev;
-	get_previous_date(current, &prev);
-
-	int len = snprintf(query_buf, QUERY_BUF_LEN,
-		"SELECT energy FROM stromzähler "
-		"WHERE timestamp >= '%04d-%02d-%02d 23:59:00' "
-		"AND timestamp < '%04d-%02d-%02d' "
-		"ORDER BY timestamp DESC LIMIT 1;",
-		prev.year, prev.month, prev.day,
-		current->year, current->month, current->day);
+	const struct writer_ops *ops = stromzaehler->writer->ops;
+	if (ops->get_counter_at_start_of_day == NULL) {
+		return;
+	}
 
-	assert(len < QUERY_BUF_LEN && "query_buf too small");
+	// the last meter values of the previous day may still be in the batch
+	if (stromzaehler->batch_len > 0) {
+		stromzaehler_flush(stromzaehler);
+	}
 
-	res = PQexec(stromzaehler->dbConn, query_buf);
-	if (res == NULL) {
-		fprintf(stderr, "PQexec failed: probably OOM\n");
+	if (!ops->get_counter_at_start_of_day(stromzaehler->writer,
+			&stromzaehler->current_date,
+			&stromzaehler->hasCounterAtStartOfDay,
+			&stromzaehler->counterAtStartOfDay)) {
 		error_exit(stromzaehler);
 	}
+}
 
-	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		fprintf(stderr, "PQexec failed: %s\n",
-			PQerrorMessage(stromzaehler->dbConn));
+// Loads the tariff file of the configuration, if there is one
+bool
+load_tariff(const struct config *config, struct tariff *tariff,
+		bool *has_tariff)
+{
+	assert(config);
+	assert(tariff);
+	assert(has_tariff);
 
-		if (PQstatus(stromzaehler->dbConn) == CONNECTION_BAD) {
-			fprintf(stderr, "Connection to database lost");
-			error_exit(stromzaehler);
-		}
+	*has_tariff = false;
+	if (*config->tariff_file == '\0') {
+		return true;
+	}
+	if (!tariff_load(tariff, config->tariff_file)) {
+		return false;
+	}
+	*has_tariff = true;
+	return true;
+}
+
+// Stores the costs of closed periods
+bool
+store_closed_costs(struct stromzaehler *stromzaehler,
+		const struct cost_closed *closed)
+{
+	assert(stromzaehler);
+	assert(closed);
 
-		goto error;
+	struct writer *writer = stromzaehler->writer;
+	if (writer->ops->write_cost == NULL) {
+		return true;
 	}
 
-	if (PQntuples(res) > 0) {
-		char *start = PQgetvalue(res, 0, 0);
-		char *end = NULL;
-		errno = 0;
-		stromzaehler->counterAtStartOfDay = strtod(start, &end);
-		if (start != end && errno == 0) {
-			stromzaehler->hasCounterAtStartOfDay = true;
-		}
+	if (closed->day && !writer->ops->write_cost(writer, COST_DAY,
+			&closed->day_date, closed->day_cost)) {
+		return false;
 	}
-error:
-	if (res) {
-		PQclear(res);
+	if (closed->month && !writer->ops->write_cost(writer, COST_MONTH,
+			&closed->month_date, closed->month_cost)) {
+		return false;
 	}
+	return true;
+}
+
+// counter_callback which only accumulates the costs
+bool
+accumulate_costs(void *ctx, time_t time, double counter)
+{
+	struct stromzaehler *stromzaehler = ctx;
+	struct cost_closed closed;
+
+	cost_accumulator_add(&stromzaehler->costs, &stromzaehler->tariff, time,
+		counter, &closed);
+	return true;
+}
+
+// counter_callback which accumulates the costs and stores closed periods
+bool
+recompute_costs(void *ctx, time_t time, double counter)
+{
+	struct stromzaehler *stromzaehler = ctx;
+	struct cost_closed closed;
+
+	cost_accumulator_add(&stromzaehler->costs, &stromzaehler->tariff, time,
+		counter, &closed);
+	return store_closed_costs(stromzaehler, &closed);
 }
 
+// Calculates the costs of the current month from the stored meter values, so
+// the running costs are known right after the start
 void
-stromzaehler_init(struct stromzaehler *stromzaehler)
+stromzaehler_init_costs(struct stromzaehler *stromzaehler)
 {
 	assert(stromzaehler);
-	stromzaehler_create_SmlReader(stromzaehler);
-	stromzaehler_connect_to_db(stromzaehler);
 
-	get_current_date(&stromzaehler->current_date);
-	stromzaehler_get_counterAtStartOfDay_from_db(stromzaehler);
+	cost_accumulator_init(&stromzaehler->costs);
 
-	counter_cache_clear(&stromzaehler->counter_cache);
+	struct writer *writer = stromzaehler->writer;
+	if (!stromzaehler->has_tariff || writer->ops->read_counters == NULL) {
+		return;
+	}
+
+	struct date first_day = stromzaehler->current_date;
+	first_day.day = 1;
+
+	// start with the last meter value of the previous month
+	time_t from = date_to_time(&first_day) - 60;
+	if (!writer->ops->read_counters(writer, from, time(NULL),
+			accumulate_costs, stromzaehler)) {
+		fprintf(stderr, "Reading the meter values of this month failed, "
+			"the costs are unknown until the next month\n");
+		cost_accumulator_init(&stromzaehler->costs);
+	}
 }
 
 bool
@@ -180,6 +352,130 @@ counter_cache_valid(struct counter_cache *cache, struct date *date)
 	return (time >= cache->timestamp && time - cache->timestamp <= 60);
 }
 
+// Continues with the state saved by the last run, so the start needs no
+// database queries. Only what can't be restored is read from the database.
+void
+stromzaehler_restore_state(struct stromzaehler *stromzaehler)
+{
+	assert(stromzaehler);
+
+	struct state_data data;
+	bool loaded = state_load(&stromzaehler->state, &data);
+	time_t now = time(NULL);
+	bool recent = loaded && data.last_frame <= now &&
+		now - data.last_frame <= STATE_MAX_AGE;
+
+	if (recent) {
+		stromzaehler->counter_cache.empty = data.counter_cache_empty;
+		stromzaehler->counter_cache.counter = data.counter_cache_counter;
+		stromzaehler->counter_cache.timestamp =
+			data.counter_cache_timestamp;
+		stromzaehler->event_detector = data.event_detector;
+		stromzaehler->validator = data.validator;
+		stromzaehler->last_committed = data.last_committed;
+	}
+
+	if (loaded && data.has_counter_at_start_of_day &&
+			date_is_equal(&data.current_date,
+			&stromzaehler->current_date)) {
+		stromzaehler->counterAtStartOfDay = data.counter_at_start_of_day;
+		stromzaehler->hasCounterAtStartOfDay = true;
+	} else if (counter_cache_valid(&stromzaehler->counter_cache,
+			&stromzaehler->current_date)) {
+		// the last run stopped shortly before midnight
+		stromzaehler->counterAtStartOfDay =
+			stromzaehler->counter_cache.counter;
+		stromzaehler->hasCounterAtStartOfDay = true;
+	} else {
+		stromzaehler_get_counterAtStartOfDay(stromzaehler);
+	}
+
+	if (recent && stromzaehler->has_tariff && data.has_costs) {
+		stromzaehler->costs = data.costs;
+	} else {
+		stromzaehler_init_costs(stromzaehler);
+	}
+
+	if (recent) {
+		fprintf(stderr, "Continuing the state of %ld s ago\n",
+			(long) (now - data.last_frame));
+		if (data.last_committed.tv_sec > 0 &&
+				data.last_committed.tv_sec < data.last_frame) {
+			fprintf(stderr, "The measurements of the last %ld s "
+				"before were lost\n", (long) (data.last_frame
+				- data.last_committed.tv_sec));
+		}
+	}
+}
+
+// Saves the state after a frame. This only copies it into the mapped state
+// file, the kernel writes it to the disk in the background.
+void
+stromzaehler_save_state(struct stromzaehler *stromzaehler)
+{
+	assert(stromzaehler);
+
+	const struct counter_cache *cache = &stromzaehler->counter_cache;
+	struct state_data data = {
+		.last_frame = cache->timestamp,
+		.last_committed = stromzaehler->last_committed,
+		.current_date = stromzaehler->current_date,
+		.has_counter_at_start_of_day =
+			stromzaehler->hasCounterAtStartOfDay,
+		.counter_at_start_of_day = stromzaehler->counterAtStartOfDay,
+		.counter_cache_empty = cache->empty,
+		.counter_cache_counter = cache->counter,
+		.counter_cache_timestamp = cache->timestamp,
+		.event_detector = stromzaehler->event_detector,
+		.validator = stromzaehler->validator,
+		.has_costs = stromzaehler->has_tariff,
+		.costs = stromzaehler->costs,
+	};
+	state_save(&stromzaehler->state, &data);
+}
+
+// Initializes the processing of the frames without a previous state
+void
+stromzaehler_init_processing(struct stromzaehler *stromzaehler)
+{
+	assert(stromzaehler);
+
+	get_current_date(&stromzaehler->current_date);
+
+	validator_init(&stromzaehler->validator);
+	counter_cache_clear(&stromzaehler->counter_cache);
+	event_detector_init(&stromzaehler->event_detector);
+
+	stromzaehler->batch_len = 0;
+	stromzaehler->last_flush = time(NULL);
+
+	if (!load_tariff(&stromzaehler->config, &stromzaehler->tariff,
+			&stromzaehler->has_tariff)) {
+		error_exit(stromzaehler);
+	}
+}
+
+void
+stromzaehler_init(struct stromzaehler *stromzaehler)
+{
+	assert(stromzaehler);
+	stromzaehler_create_SmlReader(stromzaehler);
+	stromzaehler_create_writer(stromzaehler);
+
+	if (!control_open(&stromzaehler->control,
+			stromzaehler->config.control_socket)) {
+		error_exit(stromzaehler);
+	}
+
+	if (!state_open(&stromzaehler->state,
+			stromzaehler->config.state_file)) {
+		fprintf(stderr, "Continuing without saving the state\n");
+	}
+
+	stromzaehler_init_processing(stromzaehler);
+	stromzaehler_restore_state(stromzaehler);
+}
+
 
 void
 stromzaehler_update_counterAtStartOfDay(struct stromzaehler *stromzaehler,
@@ -196,7 +492,7 @@ stromzaehler_update_counterAtStartOfDay(struct stromzaehler *stromzaehler,
 			stromzaehler->counterAtStartOfDay = stromzaehler->counter_cache.counter;
 			stromzaehler->hasCounterAtStartOfDay = true;
 		} else {
-			stromzaehler_get_counterAtStartOfDay_from_db(stromzaehler);
+			stromzaehler_get_counterAtStartOfDay(stromzaehler);
 		}
 	}
 }
@@ -206,88 +502,680 @@ insert_measurement(struct stromzaehler *stromzaehler,
 		struct measurement *measurement)
 {
 	assert(stromzaehler);
-	assert(stromzaehler->dbConn);
 	assert(measurement);
 
-	long long timestamp_sec = (long long) measurement->timestamp.tv_sec;
-	long timestamp_msec = measurement->timestamp.tv_nsec / 1000000;
+	const struct config *config = &stromzaehler->config;
+	assert(config->batch_size >= 1 && config->batch_size <= WRITER_BATCH_MAX);
+
+	stromzaehler->batch[stromzaehler->batch_len++] = *measurement;
+
+	if (stromzaehler->batch_len >= config->batch_size ||
+			measurement->timestamp.tv_sec - stromzaehler->last_flush
+			>= config->flush_interval) {
+		stromzaehler_flush(stromzaehler);
+	}
+}
+
+void
+update_current_values(struct stromzaehler *stromzaehler,
+		struct measurement *measurement)
+{
+	assert(stromzaehler);
+	assert(stromzaehler->writer);
+	assert(measurement);
+
+	struct writer *writer = stromzaehler->writer;
+	if (writer->ops->update_current == NULL) {
+		return;
+	}
 
-	char query_buf[QUERY_BUF_LEN];
+	double energy_daily = measurement->energy_count
+		- stromzaehler->counterAtStartOfDay;
+	double cost_daily, cost_monthly;
+	bool has_cost_daily = stromzaehler->has_tariff &&
+		cost_accumulator_daily(&stromzaehler->costs, &cost_daily);
+	bool has_cost_monthly = stromzaehler->has_tariff &&
+		cost_accumulator_monthly(&stromzaehler->costs, &cost_monthly);
 
-	int len = snprintf(query_buf, QUERY_BUF_LEN,
-		"INSERT INTO stromzähler(timestamp, energy, power_total, "
-		"power_phase1, power_phase2, power_phase3) "
-		"VALUES(to_timestamp(%lld.%.3ld), %.7f, %ld, %ld, %ld, %ld);",
-		timestamp_sec, timestamp_msec,
-		measurement->energy_count, lround(measurement->power),
-		lround(measurement->powerL1), lround(measurement->powerL2),
-		lround(measurement->powerL3));
-	assert(len < QUERY_BUF_LEN && "query_buf too small");
+	struct current_values values = {
+		.measurement = measurement,
+		.energy_daily = stromzaehler->hasCounterAtStartOfDay ?
+			&energy_daily : NULL,
+		.has_costs = stromzaehler->has_tariff,
+		.cost_daily = has_cost_daily ? &cost_daily : NULL,
+		.cost_monthly = has_cost_monthly ? &cost_monthly : NULL,
+	};
 
-	PGresult *res = PQexec(stromzaehler->dbConn, query_buf);
-	if (res == NULL) {
-		fprintf(stderr, "PQexec failed: probably OOM\n");
+	if (!writer->ops->update_current(writer, &values)) {
 		error_exit(stromzaehler);
 	}
+}
+
+// Adds the energy used since the last measurement to the costs
+void
+process_costs(struct stromzaehler *stromzaehler,
+		struct measurement *measurement)
+{
+	assert(stromzaehler);
+	assert(measurement);
 
-	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-		fprintf(stderr, "PQexec failed: %s\n",
-			PQerrorMessage(stromzaehler->dbConn));
+	if (!stromzaehler->has_tariff) {
+		return;
+	}
 
-		if (PQstatus(stromzaehler->dbConn) == CONNECTION_BAD) {
-			fprintf(stderr, "Connection to database lost");
-			error_exit(stromzaehler);
+	if (!recompute_costs(stromzaehler, measurement->timestamp.tv_sec,
+			measurement->energy_count)) {
+		error_exit(stromzaehler);
+	}
+}
+
+// Detects step changes of the power of each phase and stores them
+void
+process_events(struct stromzaehler *stromzaehler,
+		struct measurement *measurement)
+{
+	assert(stromzaehler);
+	assert(measurement);
+
+	struct event events[PHASES];
+	unsigned n = event_detector_update(&stromzaehler->event_detector,
+		measurement, events);
+
+	if (stromzaehler->config.log_level >= LOG_DEBUG) {
+		for (unsigned i = 0; i < n; i++) {
+			fprintf(stderr, "Load change on phase %u: %+ld W\n",
+				events[i].phase, lround(events[i].delta));
 		}
 	}
 
-	PQclear(res);
+	struct writer *writer = stromzaehler->writer;
+	if (n == 0 || writer->ops->write_events == NULL) {
+		return;
+	}
+
+	if (!writer->ops->write_events(writer, events, n)) {
+		error_exit(stromzaehler);
+	}
 }
 
+// Checks a measurement before it is processed. Invalid measurements are counted,
+// logged and stored separately for a later review (see write_quarantine), so
+// they don't affect the daily values. Returns false if the measurement must not
+// be processed. If only the voltages are invalid, the energy and power are
+// still used.
+bool
+validate_measurement(struct stromzaehler *stromzaehler,
+		struct measurement *measurement)
+{
+	assert(stromzaehler);
+	assert(stromzaehler->writer);
+	assert(measurement);
+
+	enum validation result = validator_check(&stromzaehler->validator,
+		measurement);
+
+	struct validation_stats *vs = &stromzaehler->validation_stats;
+	vs->checked++;
+	if (result == VALID) {
+		return true;
+	}
+	vs->quarantined[result]++;
+
+	if (stromzaehler->config.log_level >= LOG_DEBUG) {
+		fprintf(stderr, "Quarantined measurement (%s): energy %.4f kWh, "
+			"power %.2f W (%.2f, %.2f, %.2f), voltage %.1f, %.1f, "
+			"%.1f V\n", validation_name(result),
+			measurement->energy_count, measurement->power,
+			measurement->powerL1, measurement->powerL2,
+			measurement->powerL3, measurement->voltageL1,
+			measurement->voltageL2, measurement->voltageL3);
+	}
+
+	struct writer *writer = stromzaehler->writer;
+	if (writer->ops->write_quarantine != NULL &&
+			!writer->ops->write_quarantine(writer, measurement,
+			result)) {
+		error_exit(stromzaehler);
+	}
+	return validation_voltage_only(result);
+}
+
+// Prints the statistics since the last reset to fd and resets them if reset is
+// set. The log uses stderr since the line protocol backend may use stdout.
 void
-update_current_values(struct stromzaehler *stromzaehler,
+stromzaehler_print_stats(struct stromzaehler *stromzaehler, int fd,
+		bool reset)
+{
+	assert(stromzaehler);
+
+	struct smlReader_stats stats;
+	smlReader_collectStats(stromzaehler->smlReader, &stats, reset);
+	if (stats.frames == 0) {
+		return;
+	}
+
+	dprintf(fd, "Stats: %lu frames, %.2f wakeups/frame, period %.3f s, "
+		"latency avg %.1f ms max %.1f ms\n",
+		stats.frames, (double) stats.wakeups / stats.frames,
+		stats.frame_period, stats.latency_avg * 1000.0,
+		stats.latency_max * 1000.0);
+
+	struct writer_stats *ws = &stromzaehler->writer_stats;
+	if (ws->flushes > 0) {
+		dprintf(fd, "Stats: %s backend, %lu rows in %lu flushes, "
+			"%.3f ms/flush\n",
+			stromzaehler->writer->ops->name, ws->rows, ws->flushes,
+			ws->time * 1000.0 / ws->flushes);
+	}
+
+	struct validation_stats *vs = &stromzaehler->validation_stats;
+	unsigned long quarantined = 0;
+	for (unsigned i = VALID + 1; i < VALIDATION_RESULTS; i++) {
+		quarantined += vs->quarantined[i];
+	}
+	dprintf(fd, "Stats: %lu of %lu measurements quarantined", quarantined,
+		vs->checked);
+	for (unsigned i = VALID + 1; i < VALIDATION_RESULTS; i++) {
+		if (vs->quarantined[i] > 0) {
+			dprintf(fd, ", %lu %s", vs->quarantined[i],
+				validation_name(i));
+		}
+	}
+	dprintf(fd, "\n");
+
+	struct memory_stats *ms = &stromzaehler->memory_stats;
+	dprintf(fd, "Stats: memory rss %ld kB", memory_rss());
+	if (memory_counting() && ms->frames > 0) {
+		dprintf(fd, ", %.2f allocations/frame (libpq %.2f)",
+			(double) ms->allocations / ms->frames,
+			(double) ms->library_allocations / ms->frames);
+	}
+	dprintf(fd, "\n");
+
+	if (reset) {
+		*ws = (struct writer_stats) {0};
+		*vs = (struct validation_stats) {0};
+		ms->frames = 0;
+		ms->allocations = 0;
+		ms->library_allocations = 0;
+	}
+}
+
+void
+stromzaehler_process_frame(struct stromzaehler *stromzaehler,
 		struct measurement *measurement)
 {
 	assert(stromzaehler);
-	assert(stromzaehler->dbConn);
 	assert(measurement);
 
-	char query_buf[QUERY_BUF_LEN];
-	int len;
-	if (stromzaehler->hasCounterAtStartOfDay) {
-		len = snprintf(query_buf, QUERY_BUF_LEN,
-			"UPDATE current_values SET timestamp = CURRENT_TIMESTAMP, "
-			"energy = %.7f, energy_daily = %.7f WHERE id = 0;",
-			measurement->energy_count,
-			measurement->energy_count - stromzaehler->counterAtStartOfDay);
+	if (!validate_measurement(stromzaehler, measurement)) {
+		return;
+	}
+
+	// the cache still holds the previous frame, which is the counter at the
+	// start of the day after midnight
+	time_t now = measurement->timestamp.tv_sec;
+	stromzaehler_update_counterAtStartOfDay(stromzaehler, now);
+	counter_cache_insert(&stromzaehler->counter_cache,
+		measurement->energy_count, now);
+	insert_measurement(stromzaehler, measurement);
+	process_costs(stromzaehler, measurement);
+	update_current_values(stromzaehler, measurement);
+	process_events(stromzaehler, measurement);
+	stromzaehler_save_state(stromzaehler);
+}
+
+// Records the heap allocations of one frame. Once the program is in steady
+// state, every frame has to be processed with the memory allocated at the
+// start, so the heap can neither grow nor fragment over months of uptime. The
+// self-check at the start ensures this, a violation later is only reported.
+void
+stromzaehler_check_allocations(struct stromzaehler *stromzaehler,
+		unsigned long allocations, unsigned long library_allocations,
+		unsigned long frame)
+{
+	assert(stromzaehler);
+
+	struct memory_stats *ms = &stromzaehler->memory_stats;
+	ms->frames++;
+	ms->allocations += allocations;
+	ms->library_allocations += library_allocations;
+
+	if (allocations > 0 && frame > STEADY_STATE_FRAMES && !ms->warned) {
+		fprintf(stderr, "Warning: %lu heap allocations in frame %lu "
+			"in steady state\n", allocations, frame);
+		ms->warned = true;
+	}
+}
+
+// Processes synthetic frames with the storage backend in a dry run and exits if
+// a frame in steady state allocates heap memory outside of libpq. The frames
+// change the power to also write events and, if a tariff is configured, costs.
+// One of them has an invalid voltage and is quarantined.
+// Afterwards everything is restored, so the check doesn't affect the
+// measurements.
+void
+stromzaehler_self_check(struct stromzaehler *stromzaehler)
+{
+	assert(stromzaehler);
+	assert(stromzaehler->writer);
+
+	if (!memory_counting()) {
+		return;
+	}
+
+	struct stromzaehler saved = *stromzaehler;
+	struct writer *writer = stromzaehler->writer;
+	stromzaehler->state = (struct state) {.fd = -1};
+	stromzaehler->config.log_level = LOG_ERROR;
+	validator_init(&stromzaehler->validator);
+	event_detector_init(&stromzaehler->event_detector);
+
+	if (!writer->ops->dry_run(writer, true)) {
+		error_exit(stromzaehler);
+	}
+
+	// continue at the last known meter value, so the costs stay valid
+	double energy = 0.0;
+	if (!stromzaehler->counter_cache.empty) {
+		energy = stromzaehler->counter_cache.counter;
+	}
+	if (stromzaehler->costs.has_last &&
+			stromzaehler->costs.last_counter > energy) {
+		energy = stromzaehler->costs.last_counter;
+	}
+
+	// the first half fills the batch once and reaches the steady state, the
+	// second half has to flush it at least once without allocations
+	unsigned frames = 2 * stromzaehler->config.batch_size;
+	if (frames < 2 * EVENT_CHECK_FRAMES) {
+		frames = 2 * EVENT_CHECK_FRAMES;
+	}
+	time_t now = time(NULL);
+	unsigned long allocations = 0;
+	for (unsigned i = 0; i < frames; i++) {
+		double phase_power = (i / EVENT_CHECK_FRAMES) % 2 ? 1200.0 :
+			200.0;
+		energy += 3 * phase_power / 3.6e6;
+		struct measurement measurement = {
+			.energy_count = energy,
+			.power = 3 * phase_power,
+			.powerL1 = phase_power,
+			.powerL2 = phase_power,
+			.powerL3 = phase_power,
+			.voltageL1 = 230.0,
+			.voltageL2 = 230.0,
+			.voltageL3 = 230.0,
+			.seconds_index = i,
+			.timestamp = {.tv_sec = now + i},
+		};
+		if (i == frames - 2) {
+			measurement.voltageL1 = 400.0;
+		}
+
+		unsigned long before = memory_allocations();
+		stromzaehler_process_frame(stromzaehler, &measurement);
+		if (i >= frames / 2) {
+			allocations += memory_allocations() - before;
+		}
+	}
+
+	if (!writer->ops->dry_run(writer, false)) {
+		error_exit(stromzaehler);
+	}
+	*stromzaehler = saved;
+
+	if (allocations > 0) {
+		fprintf(stderr, "Error: The self-check made %lu heap allocations "
+			"in %u frames in steady state\n", allocations,
+			frames - frames / 2);
+		error_exit(stromzaehler);
+	}
+}
+
+// Applies a new configuration between two frames. If the serial port or the
+// storage backend can't be opened with the new settings, the old ones are kept
+// and false is returned.
+bool
+stromzaehler_apply_config(struct stromzaehler *stromzaehler,
+		struct config *config)
+{
+	assert(stromzaehler);
+	assert(config);
+
+	struct config *old = &stromzaehler->config;
+
+	// these files are only opened at the start
+	if (strcmp(config->control_socket, old->control_socket) != 0) {
+		fprintf(stderr, "Changing control_socket requires a restart\n");
+		strcpy(config->control_socket, old->control_socket);
+	}
+	if (strcmp(config->state_file, old->state_file) != 0) {
+		fprintf(stderr, "Changing state_file requires a restart\n");
+		strcpy(config->state_file, old->state_file);
+	}
+
+	struct tariff tariff;
+	bool has_tariff;
+	if (!load_tariff(config, &tariff, &has_tariff)) {
+		return false;
+	}
+
+	// only a new device is opened, the mode is switched on the open one
+	smlReader_t *reader = NULL;
+	if (strcmp(config->serial_device, old->serial_device) != 0) {
+		reader = smlReader_create(config->serial_device,
+			config->serial_adaptive);
+		if (reader == NULL) {
+			return false;
+		}
+	}
+
+	struct writer *writer = NULL;
+	if (config->storage != old->storage ||
+			strcmp(config->db_conninfo, old->db_conninfo) != 0 ||
+			strcmp(config->file_dir, old->file_dir) != 0 ||
+			strcmp(config->line_socket, old->line_socket) != 0) {
+		writer = create_writer(config);
+		if (writer == NULL) {
+			smlReader_close(reader);
+			return false;
+		}
+	}
+
+	// the new serial port and backend are open, replace the old ones
+	if (reader) {
+		smlReader_close(stromzaehler->smlReader);
+		stromzaehler->smlReader = reader;
+	} else if (config->serial_adaptive != old->serial_adaptive) {
+		smlReader_setAdaptive(stromzaehler->smlReader,
+			config->serial_adaptive);
+	}
+
+	if (writer) {
+		// The pending measurements are written to the new backend, since
+		// the old one may be unreachable, which is the usual reason to
+		// change it.
+		stromzaehler->writer->ops->close(stromzaehler->writer);
+		stromzaehler->writer = writer;
+		if (!stromzaehler->hasCounterAtStartOfDay) {
+			stromzaehler_get_counterAtStartOfDay(stromzaehler);
+		}
+	}
+
+	*old = *config;
+
+	bool had_tariff = stromzaehler->has_tariff;
+	stromzaehler->tariff = tariff;
+	stromzaehler->has_tariff = has_tariff;
+	if (has_tariff && (!had_tariff || writer)) {
+		stromzaehler_init_costs(stromzaehler);
+	}
+
+	if (stromzaehler->batch_len >= old->batch_size) {
+		stromzaehler_flush(stromzaehler);
+	}
+
+	return true;
+}
+
+// Loads the configuration file into config, starting from the defaults
+bool
+stromzaehler_load_config(struct stromzaehler *stromzaehler,
+		struct config *config)
+{
+	assert(stromzaehler);
+	assert(config);
+
+	config_set_defaults(config);
+	if (stromzaehler->config_path == NULL) {
+		return true;
+	}
+	return config_load(config, stromzaehler->config_path);
+}
+
+void
+stromzaehler_reload_config(struct stromzaehler *stromzaehler)
+{
+	assert(stromzaehler);
+
+	struct config config;
+	if (stromzaehler_load_config(stromzaehler, &config) &&
+			stromzaehler_apply_config(stromzaehler, &config)) {
+		fprintf(stderr, "Configuration reloaded\n");
+	} else {
+		fprintf(stderr, "Reloading the configuration failed, "
+			"keeping the old one\n");
+	}
+}
+
+// Commands of one client of the control socket. Changed settings are collected
+// in config and applied together after the client closed the connection.
+struct control_session {
+	struct stromzaehler *stromzaehler;
+	struct config config; // valid if changed is true
+	bool changed;
+	bool failed;
+};
+
+// Prepares the session for a change of the configuration
+void
+control_session_change(struct control_session *session)
+{
+	if (!session->changed) {
+		session->config = session->stromzaehler->config;
+		session->changed = true;
+	}
+}
+
+void
+control_command(void *ctx, int client, char *line)
+{
+	struct control_session *session = ctx;
+	struct stromzaehler *stromzaehler = session->stromzaehler;
+
+	if (line == NULL) {
+		if (session->changed) {
+			if (session->failed) {
+				control_reply(client, "error: changes discarded\n");
+			} else if (stromzaehler_apply_config(stromzaehler,
+					&session->config)) {
+				control_reply(client, "ok: changes applied\n");
+			} else {
+				control_reply(client, "error: changes couldn't be "
+					"applied\n");
+			}
+		}
+		// the next client starts with the current configuration
+		session->changed = false;
+		session->failed = false;
+		return;
+	}
+
+	char *save = NULL;
+	char *command = strtok_r(line, " \t\r", &save);
+	if (command == NULL) {
+		return;
+	}
+
+	if (strcmp(command, "set") == 0) {
+		char *key = strtok_r(NULL, " \t\r", &save);
+		char *value = strtok_r(NULL, "\r", &save);
+		control_session_change(session);
+		if (key && value &&
+				config_set(&session->config, key, value)) {
+			control_reply(client, "ok\n");
+		} else {
+			session->failed = true;
+			control_reply(client, "error: invalid setting\n");
+		}
+	} else if (strcmp(command, "reload") == 0) {
+		control_session_change(session);
+		if (stromzaehler_load_config(stromzaehler, &session->config)) {
+			control_reply(client, "ok\n");
+		} else {
+			session->failed = true;
+			control_reply(client, "error: loading the configuration "
+				"failed\n");
+		}
+	} else if (strcmp(command, "flush") == 0) {
+		stromzaehler_flush(stromzaehler);
+		control_reply(client, "ok\n");
+	} else if (strcmp(command, "stats") == 0) {
+		// the counters continue for the next periodic log
+		stromzaehler_print_stats(stromzaehler, client, false);
+		control_reply(client, "ok\n");
 	} else {
-		len = snprintf(query_buf, QUERY_BUF_LEN,
-			"UPDATE current_values SET timestamp = CURRENT_TIMESTAMP, "
-			"energy = %.7f, energy_daily = NULL WHERE id = 0;",
-			measurement->energy_count);
+		control_reply(client, "error: unknown command %s\n", command);
+	}
+}
+
+// Handles requests from the control socket and signals. Called between frames.
+void
+stromzaehler_handle_requests(struct stromzaehler *stromzaehler)
+{
+	assert(stromzaehler);
+
+	if (reload_requested) {
+		reload_requested = 0;
+		stromzaehler_reload_config(stromzaehler);
+	}
+
+	struct control_session session = {
+		.stromzaehler = stromzaehler,
+		.changed = false,
+	};
+	control_serve(&stromzaehler->control, control_command, &session);
+}
+
+void
+handle_sighup(int signal)
+{
+	(void) signal;
+	reload_requested = 1;
+}
+
+void
+handle_stop(int signal)
+{
+	(void) signal;
+	stop_requested = 1;
+}
+
+void
+install_signal_handlers(void)
+{
+	struct sigaction action = {0};
+	action.sa_handler = handle_sighup;
+	sigemptyset(&action.sa_mask);
+	// restart the blocking read() of the serial port after the signal
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGHUP, &action, NULL);
+
+	// interrupt the blocking read(), so the program stops without waiting
+	// for the next frame
+	action.sa_handler = handle_stop;
+	action.sa_flags = 0;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	// a client of the control socket may disconnect before its reply is
+	// written, which must not kill the program
+	action.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &action, NULL);
+}
+
+// Parses a date in the format yyyy-mm-dd
+bool
+parse_date(const char *s, struct date *date)
+{
+	int n = 0;
+	if (sscanf(s, "%4u-%2u-%2u%n", &date->year, &date->month, &date->day,
+			&n) != 3 || s[n] != '\0') {
+		return false;
 	}
-	assert(len < QUERY_BUF_LEN && "query_buf too small");
+	return date->year >= 1900 && date->month >= 1 && date->month <= 12 &&
+		date->day >= 1 && date->day <= 31;
+}
+
+// Recalculates the costs of all complete days and months in [from, to] from
+// the stored meter values with the current tariff
+int
+recompute_costs_batch(struct stromzaehler *stromzaehler,
+		struct date *from, struct date *to)
+{
+	assert(stromzaehler);
+	assert(from);
+	assert(to);
 
-	PGresult *res = PQexec(stromzaehler->dbConn, query_buf);
-	if (res == NULL) {
-		fprintf(stderr, "PQexec failed: probably OOM\n");
+	stromzaehler_create_writer(stromzaehler);
+	struct writer *writer = stromzaehler->writer;
+
+	if (!load_tariff(&stromzaehler->config, &stromzaehler->tariff,
+			&stromzaehler->has_tariff)) {
+		error_exit(stromzaehler);
+	}
+	if (!stromzaehler->has_tariff || writer->ops->read_counters == NULL ||
+			writer->ops->write_cost == NULL) {
+		fprintf(stderr, "Recalculating costs requires tariff_file and "
+			"the postgresql storage\n");
 		error_exit(stromzaehler);
 	}
 
-	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-		fprintf(stderr, "PQexec failed: %s\n",
-			PQerrorMessage(stromzaehler->dbConn));
+	cost_accumulator_init(&stromzaehler->costs);
 
-		if (PQstatus(stromzaehler->dbConn) == CONNECTION_BAD) {
-			fprintf(stderr, "Connection to database lost");
+	// Read one day at a time to limit the memory usage. The meter values
+	// around midnight at both ends are needed to close the periods.
+	// a day has 23 or 25 hours at a change of the daylight saving time
+	struct date after_to;
+	time_to_date(&after_to, date_to_time(to) + 36 * 60 * 60);
+	time_t start = date_to_time(from) - 60;
+	time_t end = date_to_time(&after_to) + 60;
+	while (start < end) {
+		struct date day;
+		time_to_date(&day, start + 60);
+		time_t next = date_to_time(&day) + 36 * 60 * 60;
+		time_to_date(&day, next);
+		next = date_to_time(&day);
+		if (next > end) {
+			next = end;
+		}
+
+		if (!writer->ops->read_counters(writer, start, next,
+				recompute_costs, stromzaehler)) {
 			error_exit(stromzaehler);
 		}
+		start = next;
+	}
+
+	writer->ops->close(writer);
+	return EXIT_SUCCESS;
+}
+
+// Runs the self-check without the meter, e.g. to test a configuration
+int
+self_check_batch(struct stromzaehler *stromzaehler)
+{
+	assert(stromzaehler);
+
+	if (!memory_counting()) {
+		fprintf(stderr, "Heap allocations can't be counted on this "
+			"system, skipping the self-check\n");
+		return EXIT_SUCCESS;
 	}
 
-	PQclear(res);
+	stromzaehler_create_writer(stromzaehler);
+	stromzaehler_init_processing(stromzaehler);
+	stromzaehler_init_costs(stromzaehler);
+	stromzaehler_self_check(stromzaehler);
+
+	fprintf(stderr, "Self-check passed\n");
+	stromzaehler_close(stromzaehler);
+	return EXIT_SUCCESS;
 }
 
 int
-main()
+main(int argc, char *argv[])
 {
 	// stdout and stderr are, by default, only line bufferd if they are
 	// connected to a terminal. Since that is not the case when this program is
@@ -296,19 +1184,88 @@ main()
 	setlinebuf(stdout);
 	setlinebuf(stderr);
 
-	struct stromzaehler stromzaehler;
+	// -r FROM TO recalculates the stored costs instead of reading the meter,
+	// -c only runs the self-check of the storage backend
+	bool recompute = argc >= 4 && strcmp(argv[1], "-r") == 0;
+	bool check = argc >= 2 && strcmp(argv[1], "-c") == 0;
+	struct date from, to;
+	int first_arg = recompute ? 4 : check ? 2 : 1;
+
+	if (argc > first_arg + 1 || (recompute && (!parse_date(argv[2], &from)
+			|| !parse_date(argv[3], &to)))) {
+		fprintf(stderr, "Usage: %s [-r yyyy-mm-dd yyyy-mm-dd | -c] "
+			"[configuration file]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct stromzaehler stromzaehler = {0};
+	stromzaehler.control.fd = -1;
+	stromzaehler.state.fd = -1;
+
+	// the default configuration file is optional
+	if (argc == first_arg + 1) {
+		stromzaehler.config_path = argv[first_arg];
+	} else if (access(CONFIG_DEFAULT_PATH, F_OK) == 0) {
+		stromzaehler.config_path = CONFIG_DEFAULT_PATH;
+	}
+	if (!stromzaehler_load_config(&stromzaehler, &stromzaehler.config)) {
+		return EXIT_FAILURE;
+	}
+
+	if (recompute) {
+		return recompute_costs_batch(&stromzaehler, &from, &to);
+	}
+	if (check) {
+		return self_check_batch(&stromzaehler);
+	}
+
+	install_signal_handlers();
 	stromzaehler_init(&stromzaehler);
+	// The dry run of postgresql executes statements in the database, so it is
+	// only done on request with -c
+	if (stromzaehler.config.storage != STORAGE_POSTGRESQL) {
+		stromzaehler_self_check(&stromzaehler);
+	}
+
+	// Everything is allocated now. Give the memory which was only needed for
+	// the start (e.g. the meter values to calculate the costs) back to the
+	// operating system.
+	memory_trim();
 
 	struct measurement measurement;
-	while (smlReader_nextMeasurement(stromzaehler.smlReader,
-			&measurement)) {
-		time_t now = measurement.timestamp.tv_sec;
-
-		counter_cache_insert(&stromzaehler.counter_cache,
-			measurement.energy_count, now);
-		insert_measurement(&stromzaehler, &measurement);
-		stromzaehler_update_counterAtStartOfDay(&stromzaehler, now);
-		update_current_values(&stromzaehler, &measurement);
+	unsigned long frames = 0;
+	unsigned long allocations = memory_allocations();
+	unsigned long library_allocations = memory_library_allocations();
+	while (!stop_requested && smlReader_nextMeasurement(
+			stromzaehler.smlReader, &measurement)) {
+		stromzaehler_process_frame(&stromzaehler, &measurement);
+
+		stromzaehler_check_allocations(&stromzaehler,
+			memory_allocations() - allocations,
+			memory_library_allocations() - library_allocations,
+			frames + 1);
+
+		if (++frames % stromzaehler.config.stats_interval == 0 &&
+				stromzaehler.config.log_level >= LOG_INFO) {
+			stromzaehler_print_stats(&stromzaehler, STDERR_FILENO,
+				true);
+		}
+
+		// changes of the configuration may allocate memory
+		stromzaehler_handle_requests(&stromzaehler);
+		allocations = memory_allocations();
+		library_allocations = memory_library_allocations();
+	}
+
+	stromzaehler_flush(&stromzaehler);
+	if (!stromzaehler.counter_cache.empty) {
+		stromzaehler_save_state(&stromzaehler);
+	}
+
+	if (stop_requested) {
+		fprintf(stderr, "Stopped\n");
+		stromzaehler_close(&stromzaehler);
+		return EXIT_SUCCESS;
 	}
 
 	fprintf(stderr, "smlReader_nextMeasurement() failed");
@@ -0,0 +1,165 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// Heap allocation counter and memory usage of the process.
+//
+// With glibc, malloc(), calloc() and realloc() are replaced by wrappers which
+// count the calls and forward them to the glibc allocator. Since the program
+// is linked dynamically, the wrappers are also used by the libraries (e.g.
+// libpq). Other allocation functions like posix_memalign() are not counted.
+//
+// Allocations between memory_library_begin() and memory_library_end() are
+// counted separately. They are made by a library which allocates on every
+// call, like libpq for each result, and are out of control of this program.
+
+#include "memory.h"
+#include <fcntl.h> // open()
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h> // sscanf()
+#include <unistd.h> // read(), close(), sysconf()
+
+#ifdef __GLIBC__
+#include <malloc.h> // malloc_trim()
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations = 0;
+static unsigned long library_allocations = 0;
+static unsigned library_depth = 0; // nesting of memory_library_begin()
+
+static void
+count_allocation(void)
+{
+	if (library_depth > 0) {
+		library_allocations++;
+	} else {
+		allocations++;
+	}
+}
+
+void *
+malloc(size_t size)
+{
+	count_allocation();
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	count_allocation();
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	count_allocation();
+	return __libc_realloc(ptr, size);
+}
+
+// Returns true if heap allocations are counted
+bool
+memory_counting(void)
+{
+	return true;
+}
+
+// Returns the number of heap allocations since the start of the program,
+// without the ones of libraries
+unsigned long
+memory_allocations(void)
+{
+	return allocations;
+}
+
+// Returns the number of heap allocations made by libraries
+unsigned long
+memory_library_allocations(void)
+{
+	return library_allocations;
+}
+
+// The following heap allocations are made by a library
+void
+memory_library_begin(void)
+{
+	library_depth++;
+}
+
+void
+memory_library_end(void)
+{
+	library_depth--;
+}
+
+// Returns memory which was freed after the start up to the operating system
+void
+memory_trim(void)
+{
+	malloc_trim(0);
+}
+
+#else
+
+bool
+memory_counting(void)
+{
+	return false;
+}
+
+unsigned long
+memory_allocations(void)
+{
+	return 0;
+}
+
+unsigned long
+memory_library_allocations(void)
+{
+	return 0;
+}
+
+void
+memory_library_begin(void)
+{
+}
+
+void
+memory_library_end(void)
+{
+}
+
+void
+memory_trim(void)
+{
+}
+
+#endif
+
+// Returns the resident set size in kB or -1 on error. Reads /proc without
+// allocating memory.
+long
+memory_rss(void)
+{
+	int fd = open("/proc/self/statm", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+
+	char buf[128];
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return -1;
+	}
+	buf[n] = '\0';
+
+	long size, resident;
+	if (sscanf(buf, "%ld %ld", &size, &resident) != 2) {
+		return -1;
+	}
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
@@ -0,0 +1,16 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdbool.h>
+
+bool memory_counting(void);
+unsigned long memory_allocations(void);
+unsigned long memory_library_allocations(void);
+void memory_library_begin(void);
+void memory_library_end(void);
+long memory_rss(void);
+void memory_trim(void);
+
+#endif
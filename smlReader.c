@@ -3,6 +3,8 @@
 #include <assert.h> // assert();
 #include <errno.h>
 #include <fcntl.h> // open()
+#include <poll.h> // poll()
+#include <linux/serial.h> // struct serial_struct, ASYNC_LOW_LATENCY
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h> // fprintf()
@@ -19,6 +21,16 @@
 #define SML_LEN 404
 #define READ_LEN 255 // must be > 4
 
+// Time needed to transmit one byte at 9600 baud with 8-N-1 (10 bits) in s
+#define BYTE_TIME (10.0 / 9600.0)
+
+// Weight of a new sample in the moving average of the frame period
+#define PERIOD_ALPHA 0.125
+
+// Minimal pause between two frames for the deadline of a frame, see
+// wait_frame_bytes()
+#define PAUSE_MIN 0.05 // s
+
 #define CRC_START 366
 
 #define MSG_START 59
@@ -42,8 +54,26 @@
 
 const uint8_t endSeq[] = {0x1b, 0x1b, 0x1b, 0x1b, 0x1a};
 
+// Ask the driver to push received bytes to the tty layer immediately instead
+// of deferring it. Not every driver supports this, so failures are ignored.
+static void
+serialPort_set_low_latency(int fd, bool enable)
+{
+	struct serial_struct serial;
+
+	if (ioctl(fd, TIOCGSERIAL, &serial) < 0) {
+		return;
+	}
+	if (enable) {
+		serial.flags |= ASYNC_LOW_LATENCY;
+	} else {
+		serial.flags &= ~ASYNC_LOW_LATENCY;
+	}
+	ioctl(fd, TIOCSSERIAL, &serial);
+}
+
 static int
-serialPort_open(const char* device)
+serialPort_open(const char* device, bool adaptive)
 {
 	int bits;
 	struct termios config = {0};
@@ -87,9 +117,17 @@ serialPort_open(const char* device)
 		return -1;
 	}
 
+	// read() returns after 255 bytes or if no byte was received for 0.1 s.
+	// In adaptive mode read() is additionally never asked for more bytes
+	// than are still missing in the current frame, so the read returns
+	// right after the last byte of the frame instead of after the timeout.
 	config.c_cc[VMIN] = 255;
 	config.c_cc[VTIME] = 1;
 
+	if (adaptive) {
+		serialPort_set_low_latency(fd, true);
+	}
+
 	if (tcsetattr(fd, TCSANOW, &config) < 0) {
 		fprintf(stderr, "Error: tcsetattr() failed (%s)\n",
 			strerror(errno));
@@ -101,14 +139,43 @@ serialPort_open(const char* device)
 
 struct smlReader {
 	char *device;
-	int fd;
+	int fd; // -1 if the reader reads from memory
+
+	// in-memory byte source, see smlReader_createFromMemory()
+	const uint8_t *mem;
+	size_t mem_len, mem_pos, mem_chunk;
+
 	uint8_t sml_buf[SML_LEN];
 	uint8_t read_buf[READ_LEN];
 	unsigned next, len;
+	bool adaptive;
+
+	// time when the last read() returned
+	struct timespec last_read;
+
+	// the read() which delivered the first byte of the current frame and the
+	// number of bytes received by all later read() calls
+	bool in_frame;
+	struct timespec frame_start;
+	unsigned frame_bytes;
+	bool truncated; // no byte arrived within the deadline of the frame
+
+	bool has_prev_frame;
+	struct timespec prev_frame;
+
+	struct smlReader_stats stats;
+	double latency_sum;
 };
 
+static double
+timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (double) (a->tv_sec - b->tv_sec) +
+		(double) (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
 smlReader_t *
-smlReader_create(const char *device)
+smlReader_create(const char *device, bool adaptive)
 {
 	assert(device != 0);
 
@@ -126,7 +193,8 @@ smlReader_create(const char *device)
 		return NULL;
 	}
 
-	sr->fd  = serialPort_open(device);
+	sr->adaptive = adaptive;
+	sr->fd  = serialPort_open(device, adaptive);
 	if (sr->fd == -1) {
 		free(sr->device);
 		free(sr);
@@ -136,6 +204,52 @@ smlReader_create(const char *device)
 	return sr;
 }
 
+// Creates a reader which parses the given bytes instead of a serial port. Each
+// emulated read() returns at most chunk bytes (0 = no limit), which allows to
+// split frames at arbitrary positions. The data isn't copied and must stay
+// valid until the reader is closed. smlReader_nextMeasurement() returns false
+// when all bytes are consumed.
+smlReader_t *
+smlReader_createFromMemory(const uint8_t *data, size_t len, size_t chunk)
+{
+	assert(data != NULL || len == 0);
+
+	struct smlReader *sr = calloc(1, sizeof(struct smlReader));
+	if (sr == NULL) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return NULL;
+	}
+
+	sr->device = strdup("memory");
+	if (sr->device == NULL) {
+		fprintf(stderr, "Error: strdup() failed (%s)\n",
+			strerror(errno));
+		free(sr);
+		return NULL;
+	}
+
+	sr->fd = -1;
+	sr->adaptive = true;
+	sr->mem = data;
+	sr->mem_len = len;
+	sr->mem_chunk = chunk;
+
+	return sr;
+}
+
+// Switches the adaptive mode without opening the serial port again, so the
+// bytes already received of the current frame are kept
+void
+smlReader_setAdaptive(struct smlReader *sr, bool adaptive)
+{
+	assert(sr);
+
+	if (sr->fd >= 0 && adaptive != sr->adaptive) {
+		serialPort_set_low_latency(sr->fd, adaptive);
+	}
+	sr->adaptive = adaptive;
+}
+
 void
 smlReader_close(struct smlReader *sr)
 {
@@ -143,7 +257,7 @@ smlReader_close(struct smlReader *sr)
 		return;
 	}
 
-	if (close(sr->fd) < 0) {
+	if (sr->fd >= 0 && close(sr->fd) < 0) {
 		fprintf(stderr, "Error: Closing %s faild (%s).\n",
 			sr->device, strerror(errno));
 	}
@@ -151,20 +265,94 @@ smlReader_close(struct smlReader *sr)
 	free(sr);
 }
 
+// Reads at most count bytes into read_buf. Returns the number of read bytes,
+// 0 if the in-memory source is exhausted or -1 on error.
+static ssize_t
+source_read(struct smlReader *sr, size_t count)
+{
+	assert(sr);
+	assert(count <= READ_LEN);
+
+	if (sr->fd >= 0) {
+		return read(sr->fd, sr->read_buf, count);
+	}
+
+	size_t n = sr->mem_len - sr->mem_pos;
+	if (n > count) {
+		n = count;
+	}
+	if (sr->mem_chunk > 0 && n > sr->mem_chunk) {
+		n = sr->mem_chunk;
+	}
+	memcpy(sr->read_buf, sr->mem + sr->mem_pos, n);
+	sr->mem_pos += n;
+	return n;
+}
+
+// In adaptive mode the meter sends the bytes of a frame back to back, followed
+// by a pause until the next frame which follows from the learned frame period.
+// If no byte of the current frame arrives within half of this pause, the meter
+// stopped in the middle of the frame. Returns false then, so the frame is
+// dropped and the next one isn't read as its remainder, which would lose it as
+// well.
 static bool
-readByte(struct smlReader *sr, uint8_t *dest)
+wait_frame_bytes(struct smlReader *sr)
+{
+	assert(sr);
+
+	if (!sr->adaptive || sr->fd < 0 || !sr->in_frame ||
+			sr->stats.frame_period == 0.0) {
+		return true;
+	}
+	double pause = sr->stats.frame_period - SML_LEN * BYTE_TIME;
+	if (pause < PAUSE_MIN) {
+		return true;
+	}
+
+	struct pollfd pfd = {.fd = sr->fd, .events = POLLIN};
+	// errors are reported by the following read()
+	return poll(&pfd, 1, (int) (pause / 2.0 * 1000.0)) != 0;
+}
+
+// need is the minimal number of bytes that are still missing in the current
+// frame. Since escape sequences only add bytes, it is a lower bound for the
+// number of bytes that will arrive until the end of the frame.
+static bool
+readByte(struct smlReader *sr, uint8_t *dest, unsigned need)
 {
 	assert(sr != NULL);
-	assert(sr->fd >= 0);
+	assert(need > 0);
 
 	while (sr->len == 0) {
-		int n = read(sr->fd, sr->read_buf, READ_LEN);
+		if (!wait_frame_bytes(sr)) {
+			sr->truncated = true;
+			sr->in_frame = false;
+		}
+
+		size_t count = READ_LEN;
+		if (sr->adaptive && need < READ_LEN) {
+			count = need;
+		}
+
+		ssize_t n = source_read(sr, count);
 		if (n == -1) {
-			fprintf(stderr, "Error: Reading from %s "
-				"failed (%s).\n",
-				sr->device, strerror(errno));
+			// EINTR: a signal without SA_RESTART stops the program
+			if (errno != EINTR) {
+				fprintf(stderr, "Error: Reading from %s "
+					"failed (%s).\n",
+					sr->device, strerror(errno));
+			}
+			return false;
+		}
+		if (n == 0 && sr->fd < 0) {
+			// end of the in-memory data
 			return false;
 		}
+		clock_gettime(CLOCK_MONOTONIC, &sr->last_read);
+		sr->stats.wakeups++;
+		if (sr->in_frame) {
+			sr->frame_bytes += n;
+		}
 		sr->len = n;
 		sr->next = 0;
 	}
@@ -210,14 +398,21 @@ readSmlFile(struct smlReader *sr)
 		unsigned len = 0;
 
 		// Wait for the start sequence
+		sr->in_frame = false;
 		while (len < 8) {
-			if (readByte(sr, &(sr->sml_buf[len])) == false) {
+			if (readByte(sr, &(sr->sml_buf[len]), SML_LEN - len) == false) {
 				return false;
 			}
 			if ((sr->sml_buf[len] == 0x1b && len < 4) ||
 					(sr->sml_buf[len] == 0x01 && len >= 4)) {
+				if (len == 0) {
+					sr->in_frame = true;
+					sr->frame_start = sr->last_read;
+					sr->frame_bytes = 0;
+				}
 				len++;
 			} else {
+				sr->in_frame = false;
 				len = 0;
 			}
 		}
@@ -225,8 +420,9 @@ readSmlFile(struct smlReader *sr)
 		// Read data and if two escape sequences occour in a row, ignore one
 		// escape sequence
 		unsigned esc_counter = 0;
-		while (len < SML_LEN - 8) {
-			if (readByte(sr, &(sr->sml_buf[len])) == false) {
+		sr->truncated = false;
+		while (len < SML_LEN - 8 && !sr->truncated) {
+			if (readByte(sr, &(sr->sml_buf[len]), SML_LEN - len) == false) {
 				return false;
 			}
 			if (sr->sml_buf[len] == 0x1b) {
@@ -241,13 +437,22 @@ readSmlFile(struct smlReader *sr)
 		}
 
 		// read end sequence
-		while (len < SML_LEN) {
-			if (readByte(sr, &(sr->sml_buf[len])) == false) {
+		while (len < SML_LEN && !sr->truncated) {
+			if (readByte(sr, &(sr->sml_buf[len]), SML_LEN - len) == false) {
 				return false;
 			}
 			len++;
 		}
 
+		if (sr->truncated) {
+			// the last byte belongs to the next frame, search its start
+			// sequence from there
+			fprintf(stderr, "Frame ended after %u bytes\n", len - 1);
+			sr->next--;
+			sr->len++;
+			continue;
+		}
+
 		if (check_received_data(sr) == true) {
 			break;
 		}
@@ -313,10 +518,52 @@ static void read_measurements(struct smlReader *sr, struct measurement *m) {
 	m->voltageL3 = (double) voltage / 10.0;
 }
 
+// Estimate when the last byte of the frame arrived, assuming that all bytes
+// after the read() which delivered the start of the frame arrived back to back,
+// and update the statistics with the delay until the frame was decoded.
+static void
+update_stats(struct smlReader *sr)
+{
+	assert(sr);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	// bytes left in read_buf already belong to the next frame
+	unsigned late_bytes = 0;
+	if (sr->frame_bytes > sr->len) {
+		late_bytes = sr->frame_bytes - sr->len;
+	}
+
+	double latency = timespec_diff(&now, &sr->frame_start)
+		- late_bytes * BYTE_TIME;
+	if (latency < 0.0) {
+		latency = 0.0;
+	}
+
+	sr->stats.frames++;
+	sr->latency_sum += latency;
+	if (latency > sr->stats.latency_max) {
+		sr->stats.latency_max = latency;
+	}
+
+	if (sr->has_prev_frame) {
+		double period = timespec_diff(&now, &sr->prev_frame);
+		if (sr->stats.frame_period == 0.0) {
+			sr->stats.frame_period = period;
+		} else {
+			sr->stats.frame_period += PERIOD_ALPHA
+				* (period - sr->stats.frame_period);
+		}
+	}
+	sr->prev_frame = now;
+	sr->has_prev_frame = true;
+	sr->in_frame = false;
+}
+
 bool smlReader_nextMeasurement(struct smlReader *sr, struct measurement *m)
 {
 	assert(sr != NULL);
-	assert(sr->fd >= 0);
 	assert(m != NULL);
 
 	if (readSmlFile(sr) == false) {
@@ -325,6 +572,29 @@ bool smlReader_nextMeasurement(struct smlReader *sr, struct measurement *m)
 
 	read_measurements(sr, m);
 	clock_gettime(CLOCK_REALTIME, &m->timestamp);
+	update_stats(sr);
 
 	return true;
 }
+
+void
+smlReader_collectStats(struct smlReader *sr, struct smlReader_stats *stats,
+		bool reset)
+{
+	assert(sr);
+	assert(stats);
+
+	*stats = sr->stats;
+	if (stats->frames > 0) {
+		stats->latency_avg = sr->latency_sum / stats->frames;
+	}
+	if (!reset) {
+		return;
+	}
+
+	sr->stats.frames = 0;
+	sr->stats.wakeups = 0;
+	sr->stats.latency_avg = 0.0;
+	sr->stats.latency_max = 0.0;
+	sr->latency_sum = 0.0;
+}
@@ -4,6 +4,7 @@
 #define SML_READER_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -17,7 +18,25 @@ struct measurement {
 	struct timespec timestamp;
 };
 
-smlReader_t *smlReader_create(const char *device);
+// Counters since the last call of smlReader_collectStats() with reset
+struct smlReader_stats {
+	unsigned long frames;
+	unsigned long wakeups; // number of returned read() calls
+	double frame_period; // moving average of the time between frames in s
+	// estimated time between the last byte of a frame and its decoding in s
+	double latency_avg, latency_max;
+};
+
+// In adaptive mode the serial port is put into low latency mode and every
+// read() is sized to end at the end of the current frame. A frame which stops
+// for longer than half the pause between frames, learned from the frame period,
+// is dropped without waiting for the next one.
+smlReader_t *smlReader_create(const char *device, bool adaptive);
+smlReader_t *smlReader_createFromMemory(const uint8_t *data, size_t len,
+		size_t chunk);
+void smlReader_setAdaptive(struct smlReader *sr, bool adaptive);
 void smlReader_close(struct smlReader *sr);
 bool smlReader_nextMeasurement (struct smlReader *sr, struct measurement *m);
+void smlReader_collectStats(struct smlReader *sr, struct smlReader_stats *stats,
+		bool reset);
 #endif
@@ -0,0 +1,196 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// The state is stored in a file which is mapped into memory, so saving it
+// costs only a memcpy() and survives a crash of the program. The file holds
+// two slots which are written alternately. Each slot has a checksum, so if the
+// system crashes while a slot is written, the other one is still valid.
+
+#include "state.h"
+#include <assert.h> // assert()
+#include <errno.h>
+#include <fcntl.h> // open()
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h> // fprintf()
+#include <string.h> // memcpy(), strerror()
+#include <sys/mman.h> // mmap(), msync(), munmap()
+#include <unistd.h> // ftruncate(), lseek(), close()
+
+#define STATE_MAGIC 0x54535a53 // "SZST"
+
+// Has to be increased if struct state_data changes
+#define STATE_VERSION 3
+
+struct state_slot {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size; // sizeof(struct state_data)
+	uint32_t checksum; // of sequence and data
+	uint64_t sequence;
+	struct state_data data;
+};
+
+struct state_file {
+	struct state_slot slots[2];
+};
+
+// FNV-1a
+static uint32_t
+slot_checksum(const struct state_slot *slot)
+{
+	const uint8_t *p = (const uint8_t *) &slot->sequence;
+	const uint8_t *end = (const uint8_t *) (&slot->data + 1);
+
+	uint32_t hash = 2166136261u;
+	for (; p < end; p++) {
+		hash ^= *p;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static bool
+slot_valid(const struct state_slot *slot)
+{
+	return slot->magic == STATE_MAGIC && slot->version == STATE_VERSION &&
+		slot->size == sizeof(struct state_data) &&
+		slot->checksum == slot_checksum(slot);
+}
+
+// Opens or creates the state file. An empty path disables the state file.
+bool
+state_open(struct state *state, const char *path)
+{
+	assert(state);
+	assert(path);
+
+	state->fd = -1;
+	state->map = NULL;
+
+	if (*path == '\0') {
+		return true;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Opening %s failed (%s)\n",
+			path, strerror(errno));
+		return false;
+	}
+
+	// a file of a different size can't be valid, it is reset to zeros
+	off_t size = lseek(fd, 0, SEEK_END);
+	if (size != sizeof(struct state_file) &&
+			(ftruncate(fd, 0) < 0 ||
+			ftruncate(fd, sizeof(struct state_file)) < 0)) {
+		fprintf(stderr, "Error: Resizing %s failed (%s)\n",
+			path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, sizeof(struct state_file),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Error: mmap() of %s failed (%s)\n",
+			path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	state->fd = fd;
+	state->map = map;
+	return true;
+}
+
+// Returns the most recently saved state. Returns false if there is none.
+bool
+state_load(struct state *state, struct state_data *data)
+{
+	assert(state);
+	assert(data);
+
+	if (state->map == NULL) {
+		return false;
+	}
+
+	const struct state_slot *newest = NULL;
+	for (unsigned i = 0; i < 2; i++) {
+		const struct state_slot *slot = &state->map->slots[i];
+		if (slot_valid(slot) &&
+				(newest == NULL || slot->sequence > newest->sequence)) {
+			newest = slot;
+		}
+	}
+
+	if (newest == NULL) {
+		return false;
+	}
+	*data = newest->data;
+	return true;
+}
+
+void
+state_save(struct state *state, const struct state_data *data)
+{
+	assert(state);
+	assert(data);
+
+	if (state->map == NULL) {
+		return;
+	}
+
+	// The newest valid slot has the highest sequence number. The other slot
+	// is overwritten, an invalid one first.
+	struct state_slot *slots = state->map->slots;
+	uint64_t sequence = 0;
+	unsigned oldest = 0;
+	bool has_newest = false;
+	for (unsigned i = 0; i < 2; i++) {
+		if (slot_valid(&slots[i]) &&
+				(!has_newest || slots[i].sequence > sequence)) {
+			sequence = slots[i].sequence;
+			oldest = 1 - i;
+			has_newest = true;
+		}
+	}
+
+	// overwrite the older slot, the newer one stays valid meanwhile
+	struct state_slot *slot = &slots[oldest];
+	slot->checksum = 0;
+	slot->magic = STATE_MAGIC;
+	slot->version = STATE_VERSION;
+	slot->size = sizeof(struct state_data);
+	slot->sequence = sequence + 1;
+	memcpy(&slot->data, data, sizeof(*data));
+	slot->checksum = slot_checksum(slot);
+}
+
+// Writes the state file to the disk
+void
+state_sync(struct state *state)
+{
+	assert(state);
+
+	if (state->map && msync(state->map, sizeof(struct state_file),
+			MS_SYNC) < 0) {
+		fprintf(stderr, "Error: msync() of the state file failed (%s)\n",
+			strerror(errno));
+	}
+}
+
+void
+state_close(struct state *state)
+{
+	assert(state);
+
+	if (state->map) {
+		state_sync(state);
+		munmap(state->map, sizeof(struct state_file));
+	}
+	if (state->fd >= 0) {
+		close(state->fd);
+	}
+	state->fd = -1;
+	state->map = NULL;
+}
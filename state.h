@@ -0,0 +1,47 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#ifndef STATE_H
+#define STATE_H
+
+#include "date.h"
+#include "events.h"
+#include "tariff.h"
+#include "validate.h"
+#include <stdbool.h>
+#include <time.h>
+
+// State of the program which is needed to continue after a restart without
+// querying the database
+struct state_data {
+	time_t last_frame; // time of the last processed frame
+	struct timespec last_committed; // last measurement passed to the backend
+
+	struct date current_date;
+	bool has_counter_at_start_of_day;
+	double counter_at_start_of_day;
+
+	bool counter_cache_empty;
+	double counter_cache_counter;
+	time_t counter_cache_timestamp;
+
+	struct event_detector event_detector;
+	struct validator validator;
+
+	bool has_costs;
+	struct cost_accumulator costs;
+};
+
+struct state_file;
+
+struct state {
+	int fd; // -1 if disabled
+	struct state_file *map;
+};
+
+bool state_open(struct state *state, const char *path);
+bool state_load(struct state *state, struct state_data *data);
+void state_save(struct state *state, const struct state_data *data);
+void state_sync(struct state *state);
+void state_close(struct state *state);
+
+#endif
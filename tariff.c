@@ -0,0 +1,295 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// The tariff file consists of lines
+//
+//   <valid from>  <window>     <€/kWh>
+//   2021-01-01    22:00-06:00  0.2250
+//   2021-01-01    06:00-22:00  0.3150
+//   <valid from>  base         <€/day>
+//   2021-01-01    base         0.3
+//
+// Empty lines and lines starting with '#' are ignored. From a date on, the
+// entries with the latest valid from date that isn't in the future apply.
+// Their windows have to cover the whole day without overlapping.
+
+#include "tariff.h"
+#include <assert.h> // assert()
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h> // fopen(), fgets(), sscanf(), fprintf()
+#include <string.h> // strerror(), memset()
+#include <time.h> // localtime_r()
+
+#define MINUTES_PER_DAY (24 * 60)
+
+// Meter values which are further apart are not used to calculate costs, since
+// the time of use of the energy in between is unknown
+#define MAX_GAP (15 * 60) // s
+
+static unsigned
+date_to_uint(const struct date *date)
+{
+	return date->year * 10000 + date->month * 100 + date->day;
+}
+
+static bool
+parse_entry(struct tariff_entry *entry, const char *line)
+{
+	unsigned year, month, day;
+	unsigned start_h, start_m, end_h, end_m;
+	char base[5];
+	int n;
+
+	memset(entry, 0, sizeof(*entry));
+
+	if (sscanf(line, "%4u-%2u-%2u %4s %lf %n", &year, &month, &day, base,
+			&entry->price, &n) == 5 && strcmp(base, "base") == 0) {
+		entry->base_fee = true;
+	} else if (sscanf(line, "%4u-%2u-%2u %2u:%2u-%2u:%2u %lf %n", &year,
+			&month, &day, &start_h, &start_m, &end_h, &end_m,
+			&entry->price, &n) == 8) {
+		if (start_h > 24 || end_h > 24 || start_m > 59 || end_m > 59) {
+			return false;
+		}
+		entry->start = start_h * 60 + start_m;
+		entry->end = end_h * 60 + end_m;
+		if (entry->start > MINUTES_PER_DAY ||
+				entry->end > MINUTES_PER_DAY ||
+				entry->start == entry->end) {
+			return false;
+		}
+	} else {
+		return false;
+	}
+
+	if (line[n] != '\0' || month < 1 || month > 12 || day < 1 || day > 31
+			|| entry->price < 0.0) {
+		return false;
+	}
+	entry->valid_from = year * 10000 + month * 100 + day;
+	return true;
+}
+
+// Checks that the windows of every schedule cover each minute exactly once
+static bool
+tariff_check(const struct tariff *tariff, const char *path)
+{
+	for (unsigned i = 0; i < tariff->count; i++) {
+		const struct tariff_entry *first = &tariff->entries[i];
+		if (first->base_fee) {
+			continue;
+		}
+
+		unsigned char covered[MINUTES_PER_DAY] = {0};
+		for (unsigned j = 0; j < tariff->count; j++) {
+			const struct tariff_entry *e = &tariff->entries[j];
+			if (e->base_fee || e->valid_from != first->valid_from) {
+				continue;
+			}
+			unsigned len = e->start < e->end ? e->end - e->start :
+				e->end + MINUTES_PER_DAY - e->start;
+			for (unsigned k = 0; k < len; k++) {
+				covered[(e->start + k) % MINUTES_PER_DAY]++;
+			}
+		}
+
+		for (unsigned m = 0; m < MINUTES_PER_DAY; m++) {
+			if (covered[m] != 1) {
+				fprintf(stderr, "Error: %s: the windows valid from "
+					"%u don't cover the day exactly once\n",
+					path, first->valid_from);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool
+tariff_load(struct tariff *tariff, const char *path)
+{
+	assert(tariff);
+	assert(path);
+
+	tariff->count = 0;
+
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		fprintf(stderr, "Error: Opening %s failed (%s)\n",
+			path, strerror(errno));
+		return false;
+	}
+
+	bool ok = true;
+	char line[256];
+	unsigned line_nr = 0;
+	while (fgets(line, sizeof(line), file)) {
+		line_nr++;
+		line[strcspn(line, "\r\n")] = '\0';
+
+		const char *start = line + strspn(line, " \t");
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+
+		if (tariff->count == TARIFF_MAX) {
+			fprintf(stderr, "Error: %s: more than %d entries\n",
+				path, TARIFF_MAX);
+			ok = false;
+			break;
+		}
+
+		if (!parse_entry(&tariff->entries[tariff->count], start)) {
+			fprintf(stderr, "Error: %s:%u: invalid entry\n",
+				path, line_nr);
+			ok = false;
+			continue;
+		}
+		tariff->count++;
+	}
+	fclose(file);
+
+	return ok && tariff_check(tariff, path);
+}
+
+// Returns the price per kWh at the given time or a negative value if no
+// tariff is valid
+static double
+tariff_price(const struct tariff *tariff, time_t time)
+{
+	struct tm tm;
+	localtime_r(&time, &tm);
+	unsigned date = (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100
+		+ tm.tm_mday;
+	unsigned minute = tm.tm_hour * 60 + tm.tm_min;
+
+	unsigned valid_from = 0;
+	for (unsigned i = 0; i < tariff->count; i++) {
+		const struct tariff_entry *e = &tariff->entries[i];
+		if (!e->base_fee && e->valid_from <= date &&
+				e->valid_from > valid_from) {
+			valid_from = e->valid_from;
+		}
+	}
+
+	for (unsigned i = 0; i < tariff->count; i++) {
+		const struct tariff_entry *e = &tariff->entries[i];
+		if (e->base_fee || e->valid_from != valid_from) {
+			continue;
+		}
+		bool in_window = e->start < e->end ?
+			minute >= e->start && minute < e->end :
+			minute >= e->start || minute < e->end;
+		if (in_window) {
+			return e->price;
+		}
+	}
+	return -1.0;
+}
+
+static double
+tariff_base_fee(const struct tariff *tariff, const struct date *day)
+{
+	unsigned date = date_to_uint(day);
+	unsigned valid_from = 0;
+	double fee = 0.0;
+
+	for (unsigned i = 0; i < tariff->count; i++) {
+		const struct tariff_entry *e = &tariff->entries[i];
+		if (e->base_fee && e->valid_from <= date &&
+				e->valid_from >= valid_from) {
+			valid_from = e->valid_from;
+			fee = e->price;
+		}
+	}
+	return fee;
+}
+
+void
+cost_accumulator_init(struct cost_accumulator *acc)
+{
+	assert(acc);
+	memset(acc, 0, sizeof(*acc));
+}
+
+void
+cost_accumulator_add(struct cost_accumulator *acc, const struct tariff *tariff,
+		time_t time, double counter, struct cost_closed *closed)
+{
+	assert(acc);
+	assert(tariff);
+	assert(closed);
+
+	memset(closed, 0, sizeof(*closed));
+
+	struct date day;
+	time_to_date(&day, time);
+
+	if (!acc->has_last) {
+		acc->day = day;
+		acc->day_cost = tariff_base_fee(tariff, &day);
+		acc->month_cost = 0.0;
+		acc->day_complete = false;
+		acc->month_complete = false;
+		acc->has_last = true;
+		acc->last_counter = counter;
+		acc->last_time = time;
+		return;
+	}
+
+	bool gap = time - acc->last_time > MAX_GAP;
+
+	if (!date_is_equal(&day, &acc->day)) {
+		closed->day = acc->day_complete;
+		closed->day_date = acc->day;
+		closed->day_cost = acc->day_cost;
+		acc->month_cost += acc->day_cost;
+
+		if (day.month != acc->day.month || day.year != acc->day.year) {
+			closed->month = acc->month_complete;
+			closed->month_date = acc->day;
+			closed->month_date.day = 1;
+			closed->month_cost = acc->month_cost;
+			acc->month_cost = 0.0;
+			acc->month_complete = true;
+		}
+
+		acc->day = day;
+		acc->day_cost = tariff_base_fee(tariff, &day);
+		acc->day_complete = true;
+	}
+
+	double delta = counter - acc->last_counter;
+	double price = tariff_price(tariff, time);
+	if (gap || price < 0.0) {
+		acc->day_complete = false;
+		acc->month_complete = false;
+	} else if (delta > 0.0) {
+		acc->day_cost += delta * price;
+	}
+
+	acc->last_counter = counter;
+	acc->last_time = time;
+}
+
+// Returns false if the cost of the current day is unknown
+bool
+cost_accumulator_daily(const struct cost_accumulator *acc, double *cost)
+{
+	assert(acc);
+	assert(cost);
+
+	*cost = acc->day_cost;
+	return acc->has_last && acc->day_complete;
+}
+
+// Returns false if the cost of the current month is unknown
+bool
+cost_accumulator_monthly(const struct cost_accumulator *acc, double *cost)
+{
+	assert(acc);
+	assert(cost);
+
+	*cost = acc->month_cost + acc->day_cost;
+	return acc->has_last && acc->month_complete;
+}
@@ -0,0 +1,61 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#ifndef TARIFF_H
+#define TARIFF_H
+
+#include "date.h"
+#include <stdbool.h>
+#include <time.h>
+
+#define TARIFF_MAX 32
+
+// A line of the tariff file. Either a price per kWh which is valid in a time
+// window of the day or the base fee per day.
+struct tariff_entry {
+	unsigned valid_from; // date as yyyymmdd
+	bool base_fee;
+	unsigned start, end; // minutes since midnight, the window may wrap
+	double price; // €/kWh or €/day if base_fee is true
+};
+
+struct tariff {
+	struct tariff_entry entries[TARIFF_MAX];
+	unsigned count;
+};
+
+bool tariff_load(struct tariff *tariff, const char *path);
+
+// Costs of the current day and month, updated with every meter value
+struct cost_accumulator {
+	bool has_last;
+	double last_counter; // kWh
+	time_t last_time;
+
+	struct date day; // day of the last meter value
+	double day_cost; // € including the base fee
+	double month_cost; // € of the closed days of the month
+
+	// false if the period wasn't observed from its start
+	bool day_complete, month_complete;
+};
+
+// Periods closed by a meter value. Only complete periods are reported.
+struct cost_closed {
+	bool day;
+	struct date day_date;
+	double day_cost;
+
+	bool month;
+	struct date month_date; // first day of the month
+	double month_cost;
+};
+
+void cost_accumulator_init(struct cost_accumulator *acc);
+void cost_accumulator_add(struct cost_accumulator *acc,
+		const struct tariff *tariff, time_t time, double counter,
+		struct cost_closed *closed);
+bool cost_accumulator_daily(const struct cost_accumulator *acc, double *cost);
+bool cost_accumulator_monthly(const struct cost_accumulator *acc,
+		double *cost);
+
+#endif
@@ -0,0 +1,125 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// Measures how many frames per second the SML reader parses from memory and
+// fails if the rate is below the given fraction of the baseline of this host
+// (make bench). The baseline file holds the rate in frames/s, it is written by
+// the first run or by --record. The rate must also reach an absolute minimum,
+// for hosts without a baseline. It also fails if parsing a frame allocates heap
+// memory, since the daemon must not allocate in steady state.
+//
+// Usage: bench_smlReader [--record] <baseline file> <fraction> <minimal frames/s>
+
+#include "../memory.h"
+#include "sml_frame.h"
+#include <stdio.h> // printf()
+#include <stdbool.h>
+#include <stdlib.h> // strtod(), srandom()
+#include <string.h> // strcmp()
+#include <time.h> // clock_gettime()
+
+#define FRAMES 1000
+#define RUNS 5
+#define MIN_DURATION 0.2 // s per run
+
+static uint8_t stream[FRAMES * SML_FRAME_MAX];
+static unsigned long allocations; // while parsing
+
+static double
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec + (double) t.tv_nsec / 1e9;
+}
+
+// Returns the parsed frames per second of one run
+static double
+run(size_t len)
+{
+	unsigned long frames = 0;
+	double start = now();
+	double duration;
+	do {
+		// read() sizes like from the serial port
+		smlReader_t *sr = smlReader_createFromMemory(stream, len, 255);
+		if (sr == NULL) {
+			exit(EXIT_FAILURE);
+		}
+		struct measurement m;
+		unsigned long before = memory_allocations();
+		while (smlReader_nextMeasurement(sr, &m)) {
+			frames++;
+		}
+		allocations += memory_allocations() - before;
+		smlReader_close(sr);
+		duration = now() - start;
+	} while (duration < MIN_DURATION);
+	return frames / duration;
+}
+
+int
+main(int argc, char *argv[])
+{
+	bool record = argc == 5 && strcmp(argv[1], "--record") == 0;
+	if (argc != 4 + record) {
+		fprintf(stderr, "Usage: %s [--record] <baseline file> <fraction> "
+			"<minimal frames/s>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char *baseline_path = argv[1 + record];
+	double fraction = strtod(argv[2 + record], NULL);
+	double min = strtod(argv[3 + record], NULL);
+
+	srandom(1);
+	size_t len = 0;
+	for (unsigned i = 0; i < FRAMES; i++) {
+		struct sml_values v;
+		sml_values_random(&v, i);
+		len += sml_frame_build(stream + len, &v, i % 4 == 0, false);
+	}
+
+	// the best run is the least disturbed by other processes
+	double best = 0.0;
+	for (unsigned i = 0; i < RUNS; i++) {
+		double rate = run(len);
+		if (rate > best) {
+			best = rate;
+		}
+	}
+
+	double baseline = 0.0;
+	FILE *f = record ? NULL : fopen(baseline_path, "r");
+	if (f != NULL) {
+		if (fscanf(f, "%lf", &baseline) != 1) {
+			baseline = 0.0;
+		}
+		fclose(f);
+	}
+	if (baseline > 0.0 && fraction * baseline > min) {
+		min = fraction * baseline;
+	}
+
+	printf("bench_smlReader: %.0f frames/s (baseline %.0f, minimum %.0f)\n",
+		best, baseline, min);
+	if (best < min) {
+		printf("bench_smlReader: regression, below the minimum\n");
+		return EXIT_FAILURE;
+	}
+	if (allocations > 0) {
+		printf("bench_smlReader: regression, %lu heap allocations while "
+			"parsing\n", allocations);
+		return EXIT_FAILURE;
+	}
+
+	if (baseline == 0.0) {
+		f = fopen(baseline_path, "w");
+		if (f == NULL || fprintf(f, "%.0f\n", best) < 0 ||
+				fclose(f) != 0) {
+			perror(baseline_path);
+			return EXIT_FAILURE;
+		}
+		printf("bench_smlReader: recorded the baseline in %s\n",
+			baseline_path);
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,65 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// Fuzz target of the SML reader for libFuzzer (make fuzz). The first byte of
+// the input is the maximal size of each read(), the rest is the received data.
+// Compiled with -DFUZZ_STANDALONE it reads the inputs from the files given as
+// arguments or from stdin instead, e.g. for AFL.
+
+#include "../smlReader.h"
+#include <stddef.h>
+#include <stdint.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (size == 0) {
+		return 0;
+	}
+
+	smlReader_t *sr = smlReader_createFromMemory(data + 1, size - 1,
+		data[0]);
+	if (sr == NULL) {
+		return 0;
+	}
+
+	struct measurement m;
+	while (smlReader_nextMeasurement(sr, &m)) {
+	}
+	smlReader_close(sr);
+	return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+#include <stdio.h> // fopen(), fread()
+#include <stdlib.h> // EXIT_SUCCESS
+
+static uint8_t input[1 << 20];
+
+static int
+run_file(FILE *file)
+{
+	size_t len = fread(input, 1, sizeof(input), file);
+	return LLVMFuzzerTestOneInput(input, len);
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		return run_file(stdin);
+	}
+
+	for (int i = 1; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if (file == NULL) {
+			perror(argv[i]);
+			return EXIT_FAILURE;
+		}
+		run_file(file);
+		fclose(file);
+	}
+	return EXIT_SUCCESS;
+}
+#endif
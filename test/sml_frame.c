@@ -0,0 +1,139 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// Builds SML frames like the meter sends them, for the tests of the reader.
+// The offsets are the same as in smlReader.c.
+
+#include "sml_frame.h"
+#include "../crc16.h"
+#include <assert.h> // assert()
+#include <stdlib.h> // random()
+#include <string.h> // memset(), memcpy()
+
+#define SML_LEN 404
+#define CRC_START 366
+#define MSG_START 59
+#define MSG_LEN 306
+#define END_SEQ_START 396
+#define SEC_INDEX_START 104
+#define ENERGY_COUNT_START 168
+#define POWER_START 192
+#define POWER_L1_START 216
+#define POWER_L2_START 240
+#define POWER_L3_START 264
+#define VOLTAGE_L1_START 288
+#define VOLTAGE_L2_START 306
+#define VOLTAGE_L3_START 324
+
+// Bytes of the message which aren't read, an injected escape sequence goes
+// there
+#define FILLER_START 120
+
+#define ESC 0x1b
+
+static void
+write_be(uint8_t *dest, uint64_t value, unsigned len)
+{
+	for (unsigned i = 0; i < len; i++) {
+		dest[i] = value >> (8 * (len - 1 - i));
+	}
+}
+
+static int64_t
+random_range(int64_t min, int64_t max)
+{
+	uint64_t r = ((uint64_t) random() << 31) ^ (uint64_t) random();
+	return min + (int64_t) (r % (uint64_t) (max - min + 1));
+}
+
+void
+sml_values_random(struct sml_values *v, uint32_t seconds_index)
+{
+	assert(v);
+
+	v->seconds_index = seconds_index;
+	v->energy = random_range(0, 1000000ll * 10000000ll);
+	v->power_l1 = random_range(-1000000, 1000000);
+	v->power_l2 = random_range(-1000000, 1000000);
+	v->power_l3 = random_range(-1000000, 1000000);
+	v->power = v->power_l1 + v->power_l2 + v->power_l3;
+	v->voltage_l1 = random_range(0, 0xffff);
+	v->voltage_l2 = random_range(0, 0xffff);
+	v->voltage_l3 = random_range(0, 0xffff);
+}
+
+// Writes the frame with the values v to wire and returns its length. Four
+// escape bytes in a row in the message are doubled, like the meter does. If
+// escape is true, such a sequence is put into the message. If corrupt is true,
+// one bit of the message is flipped after the checksum was calculated.
+size_t
+sml_frame_build(uint8_t *wire, const struct sml_values *v, bool escape,
+		bool corrupt)
+{
+	assert(wire);
+	assert(v);
+
+	uint8_t frame[SML_LEN];
+	memset(frame, 0x42, sizeof(frame));
+	memset(frame, ESC, 4);
+	memset(frame + 4, 0x01, 4);
+
+	write_be(frame + SEC_INDEX_START, v->seconds_index, 4);
+	write_be(frame + ENERGY_COUNT_START, v->energy, 8);
+	write_be(frame + POWER_START, v->power, 8);
+	write_be(frame + POWER_L1_START, v->power_l1, 8);
+	write_be(frame + POWER_L2_START, v->power_l2, 8);
+	write_be(frame + POWER_L3_START, v->power_l3, 8);
+	write_be(frame + VOLTAGE_L1_START, v->voltage_l1, 2);
+	write_be(frame + VOLTAGE_L2_START, v->voltage_l2, 2);
+	write_be(frame + VOLTAGE_L3_START, v->voltage_l3, 2);
+	if (escape) {
+		memset(frame + FILLER_START, ESC, 4);
+	}
+	write_be(frame + CRC_START, crc16(frame + MSG_START, MSG_LEN), 2);
+	if (corrupt) {
+		frame[MSG_START + random_range(0, MSG_LEN - 1)] ^=
+			1 << random_range(0, 7);
+	}
+
+	memset(frame + END_SEQ_START, ESC, 4);
+	frame[END_SEQ_START + 4] = 0x1a;
+	memset(frame + END_SEQ_START + 5, 0, 3);
+
+	size_t len = 0;
+	memcpy(wire, frame, 8);
+	len += 8;
+
+	unsigned run = 0;
+	for (unsigned i = 8; i < END_SEQ_START; i++) {
+		wire[len++] = frame[i];
+		run = frame[i] == ESC ? run + 1 : 0;
+		if (run == 4) {
+			memset(wire + len, ESC, 4);
+			len += 4;
+			run = 0;
+		}
+	}
+
+	memcpy(wire + len, frame + END_SEQ_START, SML_LEN - END_SEQ_START);
+	len += SML_LEN - END_SEQ_START;
+	assert(len <= SML_FRAME_MAX);
+	return len;
+}
+
+// Returns true if the reader decoded the values v into m
+bool
+sml_values_equal(const struct sml_values *v, const struct measurement *m)
+{
+	assert(v);
+	assert(m);
+
+	return m->seconds_index == v->seconds_index &&
+		m->energy_count == (double) v->energy / 10000000.0 &&
+		m->power == (double) v->power / 100.0 &&
+		m->powerL1 == (double) v->power_l1 / 100.0 &&
+		m->powerL2 == (double) v->power_l2 / 100.0 &&
+		m->powerL3 == (double) v->power_l3 / 100.0 &&
+		m->voltageL1 == (double) v->voltage_l1 / 10.0 &&
+		m->voltageL2 == (double) v->voltage_l2 / 10.0 &&
+		m->voltageL3 == (double) v->voltage_l3 / 10.0;
+}
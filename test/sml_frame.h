@@ -0,0 +1,27 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#ifndef SML_FRAME_H
+#define SML_FRAME_H
+
+#include "../smlReader.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Maximal length of an escaped frame
+#define SML_FRAME_MAX (2 * 404)
+
+// Raw values of a frame in the units of the meter
+struct sml_values {
+	uint32_t seconds_index;
+	int64_t energy; // 10^-7 kWh
+	int64_t power, power_l1, power_l2, power_l3; // 0.01 W
+	uint16_t voltage_l1, voltage_l2, voltage_l3; // 0.1 V
+};
+
+void sml_values_random(struct sml_values *v, uint32_t seconds_index);
+size_t sml_frame_build(uint8_t *wire, const struct sml_values *v, bool escape,
+		bool corrupt);
+bool sml_values_equal(const struct sml_values *v, const struct measurement *m);
+
+#endif
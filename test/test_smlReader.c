@@ -0,0 +1,201 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// Property tests of the SML reader: streams of random frames are parsed from
+// memory with random read() sizes, escape sequences, corrupt checksums and
+// garbage between the frames. The decoded values must match exactly.
+//
+// Usage: test_smlReader [seed]
+//        test_smlReader --fuzz-seed > file   (writes an input for the fuzzer)
+
+#include "sml_frame.h"
+#include <fcntl.h> // open()
+#include <stdbool.h>
+#include <stdio.h> // printf(), fwrite()
+#include <stdlib.h> // random(), srandom(), strtoul()
+#include <string.h> // strcmp()
+#include <unistd.h> // dup(), dup2(), close()
+
+#define FRAMES 200
+#define TRIALS 50
+
+static uint8_t stream[FRAMES * (SML_FRAME_MAX + 32)];
+static struct sml_values values[FRAMES];
+static bool corrupt[FRAMES];
+
+static unsigned failures = 0;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+		failures++; \
+	} \
+} while (0)
+
+// The reader reports checksum errors on stderr, which would flood the output
+static int saved_stderr = -1;
+
+static void
+quiet(bool on)
+{
+	if (on) {
+		saved_stderr = dup(STDERR_FILENO);
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDERR_FILENO);
+		close(null);
+	} else {
+		dup2(saved_stderr, STDERR_FILENO);
+		close(saved_stderr);
+	}
+}
+
+struct options {
+	bool escapes; // every frame contains an escape sequence
+	bool corrupt; // some frames have a wrong checksum
+	bool garbage; // random bytes between the frames
+};
+
+// Builds a stream of FRAMES frames and returns its length
+static size_t
+build_stream(const struct options *opt)
+{
+	size_t len = 0;
+	for (unsigned i = 0; i < FRAMES; i++) {
+		if (opt->garbage) {
+			unsigned n = random() % 32;
+			for (unsigned j = 0; j < n; j++) {
+				// without escape bytes, no frame can start here
+				uint8_t b = random() % 256;
+				stream[len++] = b == 0x1b ? 0x1c : b;
+			}
+		}
+		sml_values_random(&values[i], i);
+		corrupt[i] = opt->corrupt && random() % 8 == 0;
+		len += sml_frame_build(stream + len, &values[i],
+			opt->escapes || random() % 4 == 0, corrupt[i]);
+	}
+	return len;
+}
+
+// Parses the stream and checks that exactly the frames with a valid checksum
+// are returned in order
+static void
+check_stream(const char *name, size_t len, size_t chunk)
+{
+	smlReader_t *sr = smlReader_createFromMemory(stream, len, chunk);
+	CHECK(sr != NULL, "%s: creating the reader failed", name);
+	if (sr == NULL) {
+		return;
+	}
+
+	struct measurement m;
+	unsigned i = 0;
+	quiet(true);
+	while (smlReader_nextMeasurement(sr, &m)) {
+		while (i < FRAMES && corrupt[i]) {
+			i++;
+		}
+		if (i == FRAMES) {
+			break;
+		}
+		if (!sml_values_equal(&values[i], &m)) {
+			break;
+		}
+		i++;
+	}
+	quiet(false);
+	while (i < FRAMES && corrupt[i]) {
+		i++;
+	}
+	CHECK(i == FRAMES, "%s: chunk %zu: frame %u wrong or missing", name,
+		chunk, i);
+	smlReader_close(sr);
+}
+
+static void
+test_property(const char *name, const struct options *opt)
+{
+	for (unsigned t = 0; t < TRIALS; t++) {
+		size_t len = build_stream(opt);
+		// 0 = whole read_buf, otherwise frames are split at random points
+		size_t chunk = t == 0 ? 0 : 1 + random() % 300;
+		check_stream(name, len, chunk);
+	}
+}
+
+// Random and mutated input must neither crash nor read out of bounds, which the
+// sanitizers check
+static void
+test_robustness(void)
+{
+	struct options opt = {.escapes = true, .corrupt = true, .garbage = true};
+	quiet(true);
+	for (unsigned t = 0; t < TRIALS; t++) {
+		size_t len = build_stream(&opt);
+		unsigned mutations = random() % 64;
+		for (unsigned j = 0; j < mutations; j++) {
+			stream[random() % len] = random() % 4 == 0 ?
+				0x1b : random() % 256;
+		}
+		if (t % 10 == 0) {
+			for (size_t j = 0; j < len; j++) {
+				stream[j] = random() % 256;
+			}
+		}
+
+		smlReader_t *sr = smlReader_createFromMemory(stream, len,
+			random() % 300);
+		struct measurement m;
+		unsigned frames = 0;
+		while (smlReader_nextMeasurement(sr, &m)) {
+			frames++;
+		}
+		smlReader_close(sr);
+		CHECK(frames <= FRAMES + len / 404, "robustness: too many frames");
+	}
+	quiet(false);
+}
+
+// Writes three frames for the fuzzer, the first byte is the read() size
+static int
+write_fuzz_seed(void)
+{
+	uint8_t seed[1 + 3 * SML_FRAME_MAX];
+	size_t len = 0;
+	seed[len++] = 0;
+	for (unsigned i = 0; i < 3; i++) {
+		struct sml_values v;
+		sml_values_random(&v, i);
+		len += sml_frame_build(seed + len, &v, i == 1, false);
+	}
+	return fwrite(seed, 1, len, stdout) == len ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc == 2 && strcmp(argv[1], "--fuzz-seed") == 0) {
+		srandom(1);
+		return write_fuzz_seed();
+	}
+
+	unsigned seed = argc == 2 ? strtoul(argv[1], NULL, 10) : 1;
+	srandom(seed);
+	printf("test_smlReader: seed %u\n", seed);
+
+	test_property("split", &(struct options) {0});
+	test_property("escapes", &(struct options) {.escapes = true});
+	test_property("crc", &(struct options) {.corrupt = true});
+	test_property("garbage", &(struct options) {.garbage = true});
+	test_property("all", &(struct options) {.escapes = true,
+		.corrupt = true, .garbage = true});
+	test_robustness();
+
+	if (failures > 0) {
+		printf("test_smlReader: %u failures\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("test_smlReader: ok\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,226 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// Checks every measurement before it is stored. The checks only compare the
+// measurement with the last valid one and moving averages, so they take
+// constant time. Rejected measurements don't affect the daily energy and costs,
+// since the next valid measurement contains the whole energy counter again.
+// The voltages are checked last: if only they are invalid, the energy and
+// power of the measurement are still used.
+
+#include "validate.h"
+#include <assert.h> // assert()
+#include <math.h> // fabs(), fmax(), sqrt()
+#include <stdbool.h>
+#include <string.h> // memset()
+
+// Maximal power of one phase, with margin above a main fuse of 63 A at 253 V
+#define PHASE_POWER_MAX 20000.0 // W
+#define POWER_MAX (PHASES * PHASE_POWER_MAX) // W
+
+// Mains voltage is 230 V ± 10 % (EN 50160), with margin for measurement errors.
+// A phase without voltage and power is valid, e.g. during a power failure of
+// one phase.
+#define VOLTAGE_MIN 160.0 // V
+#define VOLTAGE_MAX 280.0 // V
+
+// Allowed difference between the power and the sum of the phases
+#define SUM_TOLERANCE_MIN 20.0 // W
+#define SUM_TOLERANCE 0.05 // relative to the power
+
+// Allowed increase of the energy counter in addition to POWER_MAX for the time
+// between two measurements, for the resolution of the counter
+#define ENERGY_SLACK 0.001 // kWh
+
+// After this number of consecutive measurements rejected by the energy
+// counter, the counter is assumed to be valid, e.g. after a meter change
+#define ENERGY_RESYNC 60
+
+// Weight of a new sample in the moving mean and variance of the voltages
+#define ZSCORE_ALPHA 0.02
+// Number of samples before outliers are detected
+#define ZSCORE_MIN_SAMPLES 30
+// Deviation from the mean in standard deviations which is an outlier
+#define ZSCORE_MAX 10.0
+// Lower bound of the standard deviation, so small changes of a very steady
+// voltage aren't outliers
+#define ZSCORE_STD_MIN 1.0 // V
+// After this number of consecutive outliers the value is assumed to have
+// changed permanently and the statistics start again
+#define ZSCORE_RESYNC 5
+
+void
+validator_init(struct validator *v)
+{
+	assert(v);
+	memset(v, 0, sizeof(*v));
+}
+
+static bool
+zscore_outlier(const struct zscore *z, double value)
+{
+	assert(z);
+
+	if (z->count < ZSCORE_MIN_SAMPLES) {
+		return false;
+	}
+	double std = fmax(sqrt(z->variance), ZSCORE_STD_MIN);
+	return fabs(value - z->mean) > ZSCORE_MAX * std;
+}
+
+static void
+zscore_update(struct zscore *z, double value)
+{
+	assert(z);
+
+	z->outliers = 0;
+	if (z->count == 0) {
+		z->mean = value;
+		z->variance = 0.0;
+		z->count = 1;
+		return;
+	}
+
+	double delta = value - z->mean;
+	z->mean += ZSCORE_ALPHA * delta;
+	z->variance = (1.0 - ZSCORE_ALPHA) *
+		(z->variance + ZSCORE_ALPHA * delta * delta);
+	if (z->count < ZSCORE_MIN_SAMPLES) {
+		z->count++;
+	}
+}
+
+static enum validation
+check_power(const struct measurement *m)
+{
+	const double powers[PHASES] = {m->powerL1, m->powerL2, m->powerL3};
+
+	if (fabs(m->power) > POWER_MAX) {
+		return INVALID_POWER_RANGE;
+	}
+	for (unsigned i = 0; i < PHASES; i++) {
+		if (fabs(powers[i]) > PHASE_POWER_MAX) {
+			return INVALID_POWER_RANGE;
+		}
+	}
+
+	double sum = m->powerL1 + m->powerL2 + m->powerL3;
+	if (fabs(sum - m->power) >
+			fmax(SUM_TOLERANCE_MIN, SUM_TOLERANCE * fabs(m->power))) {
+		return INVALID_POWER_SUM;
+	}
+	return VALID;
+}
+
+static enum validation
+check_energy(const struct validator *v, const struct measurement *m)
+{
+	if (!v->has_last) {
+		return VALID;
+	}
+	if (m->energy_count < v->last_energy) {
+		return INVALID_ENERGY_BACKWARDS;
+	}
+
+	// the seconds index of the meter doesn't depend on the system clock
+	uint32_t seconds = m->seconds_index - v->last_seconds_index;
+	double max_increase = POWER_MAX * seconds / 3.6e6 + ENERGY_SLACK;
+	if (m->energy_count - v->last_energy > max_increase) {
+		return INVALID_ENERGY_JUMP;
+	}
+	return VALID;
+}
+
+static enum validation
+check_voltages(struct validator *v, const struct measurement *m)
+{
+	const double powers[PHASES] = {m->powerL1, m->powerL2, m->powerL3};
+	const double voltages[PHASES] = {m->voltageL1, m->voltageL2,
+		m->voltageL3};
+
+	for (unsigned i = 0; i < PHASES; i++) {
+		bool no_voltage = voltages[i] == 0.0 && powers[i] == 0.0;
+		if (!no_voltage && (voltages[i] < VOLTAGE_MIN ||
+				voltages[i] > VOLTAGE_MAX)) {
+			return INVALID_VOLTAGE_RANGE;
+		}
+	}
+
+	bool outlier = false;
+	for (unsigned i = 0; i < PHASES; i++) {
+		struct zscore *z = &v->voltages[i];
+		if (voltages[i] != 0.0 && zscore_outlier(z, voltages[i])) {
+			if (++z->outliers < ZSCORE_RESYNC) {
+				outlier = true;
+			} else {
+				z->count = 0;
+			}
+		}
+	}
+	if (outlier) {
+		return INVALID_OUTLIER;
+	}
+
+	for (unsigned i = 0; i < PHASES; i++) {
+		if (voltages[i] != 0.0) {
+			zscore_update(&v->voltages[i], voltages[i]);
+		}
+	}
+	return VALID;
+}
+
+// Checks a measurement. Only valid energy counters and voltages are used for the
+// checks of the following ones.
+enum validation
+validator_check(struct validator *v, const struct measurement *m)
+{
+	assert(v);
+	assert(m);
+
+	enum validation result = check_power(m);
+	if (result != VALID) {
+		return result;
+	}
+
+	result = check_energy(v, m);
+	if (result != VALID && ++v->energy_rejects < ENERGY_RESYNC) {
+		return result;
+	}
+
+	v->has_last = true;
+	v->last_energy = m->energy_count;
+	v->last_seconds_index = m->seconds_index;
+	v->energy_rejects = 0;
+	return check_voltages(v, m);
+}
+
+// Returns true if only the voltages of the measurement are invalid, so its
+// energy and power can be used
+bool
+validation_voltage_only(enum validation result)
+{
+	return result == INVALID_VOLTAGE_RANGE || result == INVALID_OUTLIER;
+}
+
+const char *
+validation_name(enum validation result)
+{
+	switch (result) {
+	case VALID:
+		return "valid";
+	case INVALID_ENERGY_BACKWARDS:
+		return "energy backwards";
+	case INVALID_ENERGY_JUMP:
+		return "energy jump";
+	case INVALID_POWER_RANGE:
+		return "power range";
+	case INVALID_VOLTAGE_RANGE:
+		return "voltage range";
+	case INVALID_POWER_SUM:
+		return "power sum";
+	case INVALID_OUTLIER:
+		return "voltage outlier";
+	case VALIDATION_RESULTS:
+		break;
+	}
+	return "unknown";
+}
@@ -0,0 +1,44 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include "events.h" // PHASES
+#include "smlReader.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+enum validation {
+	VALID,
+	INVALID_ENERGY_BACKWARDS, // the energy counter decreased
+	INVALID_ENERGY_JUMP, // the energy counter increased faster than possible
+	INVALID_POWER_RANGE,
+	INVALID_VOLTAGE_RANGE,
+	INVALID_POWER_SUM, // the power of the phases doesn't add up to the power
+	INVALID_OUTLIER, // a voltage deviates too much from the recent ones
+	VALIDATION_RESULTS // number of results
+};
+
+// Moving mean and variance of a value
+struct zscore {
+	unsigned count; // number of samples, at most ZSCORE_MIN_SAMPLES
+	double mean, variance;
+	unsigned outliers; // number of consecutive outliers
+};
+
+struct validator {
+	bool has_last;
+	double last_energy; // kWh, of the last valid sample
+	uint32_t last_seconds_index;
+	unsigned energy_rejects; // number of consecutive rejects by the counter
+
+	struct zscore voltages[PHASES];
+};
+
+void validator_init(struct validator *v);
+enum validation validator_check(struct validator *v,
+		const struct measurement *m);
+bool validation_voltage_only(enum validation result);
+const char *validation_name(enum validation result);
+
+#endif
@@ -0,0 +1,102 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include "date.h"
+#include "events.h"
+#include "smlReader.h"
+#include "validate.h"
+#include <stdbool.h>
+#include <time.h>
+
+// Maximal number of measurements passed to one call of write()
+#define WRITER_BATCH_MAX 60
+
+struct writer;
+
+// Values for the table current_values. Unknown values are NULL.
+struct current_values {
+	const struct measurement *measurement;
+	const double *energy_daily; // kWh
+	// The costs are only stored if has_costs is set (a tariff is configured),
+	// so databases without the cost columns keep working.
+	bool has_costs;
+	const double *cost_daily, *cost_monthly; // €
+};
+
+enum cost_period {
+	COST_DAY,
+	COST_MONTH,
+};
+
+// Called for every meter value in ascending order of time. Returning false
+// aborts the reading.
+typedef bool (*counter_callback)(void *ctx, time_t time, double counter);
+
+// Interface of a storage backend. All functions return false on a fatal error,
+// after which the program exits. Optional functions may be NULL.
+struct writer_ops {
+	const char *name;
+
+	// While a dry run is enabled, everything written is discarded when it is
+	// disabled again (or not written at all). Used by the self-check.
+	// Disabling it returns false if anything failed meanwhile. Apart from
+	// libraries, backends must not allocate heap memory after their creation.
+	bool (*dry_run)(struct writer *w, bool enable);
+
+	bool (*write)(struct writer *w, const struct measurement *m,
+		unsigned n);
+
+	// optional, store detected load changes
+	bool (*write_events)(struct writer *w, const struct event *e,
+		unsigned n);
+
+	// optional, store a measurement which failed the validation for a later
+	// review, reason is the result of validator_check()
+	bool (*write_quarantine)(struct writer *w, const struct measurement *m,
+		enum validation reason);
+
+	// optional, update the current meter value and the energy used and cost
+	// of today
+	bool (*update_current)(struct writer *w,
+		const struct current_values *values);
+
+	// optional, store the cost of a closed day or month. For a month date is
+	// its first day. An existing cost of the same period is replaced.
+	bool (*write_cost)(struct writer *w, enum cost_period period,
+		const struct date *date, double cost);
+
+	// optional, read the stored meter values in [from, to). Backends may
+	// return only the last value of each minute.
+	bool (*read_counters)(struct writer *w, time_t from, time_t to,
+		counter_callback callback, void *ctx);
+
+	// optional, look up the last meter value of the day before date. found
+	// is set to false if no value is stored.
+	bool (*get_counter_at_start_of_day)(struct writer *w,
+		const struct date *date, bool *found, double *counter);
+
+	// make everything written so far durable or visible to readers
+	bool (*flush)(struct writer *w);
+
+	void (*close)(struct writer *w);
+};
+
+// Every backend embeds this struct as its first member
+struct writer {
+	const struct writer_ops *ops;
+};
+
+// Backends, return NULL on error after printing a message
+
+// PostgreSQL database, conninfo as accepted by PQconnectdb()
+struct writer *writer_pg_create(const char *conninfo);
+
+// Append-only columnar files in the directory dir
+struct writer *writer_file_create(const char *dir);
+
+// InfluxDB line protocol on stdout (path = NULL) or a Unix stream socket
+struct writer *writer_line_create(const char *path);
+
+#endif
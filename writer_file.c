@@ -0,0 +1,347 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// Storage backend for hosts without a database. The directory contains:
+//
+// measurements.col  Append-only sequence of blocks. Each block is the header
+//                   (uint32 magic "SZM1", uint32 count) followed by the
+//                   columns int64 timestamp[count] (ms since the epoch),
+//                   double energy[count] (kWh) and int32 power_total[count],
+//                   power_phase1[count], power_phase2[count],
+//                   power_phase3[count] (W).
+// events.col        Same layout with the magic "SZE1" and the columns int64
+//                   timestamp[count], int32 phase[count],
+//                   delta_power[count], power[count].
+// quarantine.col    Same layout with the magic "SZQ1" for the measurements
+//                   which failed the validation, with the columns int64
+//                   timestamp[count], int32 reason[count] (enum validation in
+//                   validate.h), double energy[count], int32
+//                   power_total[count], power_phase1..3[count] and double
+//                   voltage_phase1..3[count] (V).
+// current           One record int64 timestamp, double energy, double
+//                   energy_daily, double cost_daily, double cost_monthly
+//                   (NaN if unknown), overwritten in place.
+//
+// All values are stored in the byte order of the host. A block is written
+// with a single write(), so readers never see a partial block.
+
+#include "writer.h"
+#include <assert.h> // assert()
+#include <errno.h>
+#include <fcntl.h> // open()
+#include <limits.h> // PATH_MAX
+#include <math.h> // lround(), NAN
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h> // snprintf(), fprintf()
+#include <stdlib.h> // calloc(), free()
+#include <string.h> // memcpy(), strerror()
+#include <sys/stat.h> // mkdir()
+#include <unistd.h> // write(), pwrite(), fdatasync(), close()
+
+#define MAGIC_MEASUREMENTS 0x314d5a53 // "SZM1"
+#define MAGIC_EVENTS 0x31455a53 // "SZE1"
+#define MAGIC_QUARANTINE 0x31515a53 // "SZQ1"
+
+#define HEADER_LEN (2 * sizeof(uint32_t))
+#define MEASUREMENT_LEN (sizeof(int64_t) + sizeof(double) + 4 * sizeof(int32_t))
+#define EVENT_LEN (sizeof(int64_t) + 3 * sizeof(int32_t))
+#define QUARANTINE_LEN (sizeof(int64_t) + 5 * sizeof(int32_t) + \
+	4 * sizeof(double))
+
+struct writer_file {
+	struct writer writer;
+	char *dir;
+	int measurements_fd, events_fd, quarantine_fd, current_fd;
+	bool dry_run; // the blocks are built but not written
+	uint8_t block[HEADER_LEN + WRITER_BATCH_MAX * MEASUREMENT_LEN];
+};
+
+static int64_t
+timestamp_ms(const struct timespec *ts)
+{
+	return (int64_t) ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
+// Appends the values to the column which starts at column[0]. Returns the
+// position after the column.
+static uint8_t *
+put_column(uint8_t *column, const void *value, size_t size, unsigned i,
+		unsigned n)
+{
+	memcpy(column + i * size, value, size);
+	return column + n * size;
+}
+
+static uint8_t *
+put_header(uint8_t *block, uint32_t magic, uint32_t count)
+{
+	memcpy(block, &magic, sizeof(magic));
+	memcpy(block + sizeof(magic), &count, sizeof(count));
+	return block + HEADER_LEN;
+}
+
+static bool
+write_block(struct writer_file *fw, int fd, size_t len)
+{
+	if (fw->dry_run) {
+		return true;
+	}
+
+	ssize_t n = write(fd, fw->block, len);
+	if (n < 0 || (size_t) n != len) {
+		fprintf(stderr, "Error: Writing to %s failed (%s)\n",
+			fw->dir, n < 0 ? strerror(errno) : "short write");
+		return false;
+	}
+	return true;
+}
+
+static bool
+file_write(struct writer *w, const struct measurement *m, unsigned n)
+{
+	struct writer_file *fw = (struct writer_file *) w;
+	assert(fw);
+	assert(m || n == 0);
+	assert(n <= WRITER_BATCH_MAX);
+
+	if (n == 0) {
+		return true;
+	}
+
+	uint8_t *timestamps = put_header(fw->block, MAGIC_MEASUREMENTS, n);
+	for (unsigned i = 0; i < n; i++) {
+		int64_t timestamp = timestamp_ms(&m[i].timestamp);
+		int32_t power[4] = {
+			lround(m[i].power), lround(m[i].powerL1),
+			lround(m[i].powerL2), lround(m[i].powerL3)
+		};
+
+		uint8_t *column = put_column(timestamps, &timestamp,
+			sizeof(timestamp), i, n);
+		column = put_column(column, &m[i].energy_count,
+			sizeof(m[i].energy_count), i, n);
+		for (unsigned j = 0; j < 4; j++) {
+			column = put_column(column, &power[j], sizeof(power[j]),
+				i, n);
+		}
+	}
+
+	return write_block(fw, fw->measurements_fd,
+		HEADER_LEN + n * MEASUREMENT_LEN);
+}
+
+static bool
+file_write_events(struct writer *w, const struct event *e, unsigned n)
+{
+	struct writer_file *fw = (struct writer_file *) w;
+	assert(fw);
+	assert(e || n == 0);
+	assert(HEADER_LEN + n * EVENT_LEN <= sizeof(fw->block));
+
+	if (n == 0) {
+		return true;
+	}
+
+	uint8_t *timestamps = put_header(fw->block, MAGIC_EVENTS, n);
+	for (unsigned i = 0; i < n; i++) {
+		int64_t timestamp = timestamp_ms(&e[i].timestamp);
+		int32_t values[3] = {
+			e[i].phase, lround(e[i].delta), lround(e[i].power)
+		};
+
+		uint8_t *column = put_column(timestamps, &timestamp,
+			sizeof(timestamp), i, n);
+		for (unsigned j = 0; j < 3; j++) {
+			column = put_column(column, &values[j],
+				sizeof(values[j]), i, n);
+		}
+	}
+
+	return write_block(fw, fw->events_fd, HEADER_LEN + n * EVENT_LEN);
+}
+
+static bool
+file_write_quarantine(struct writer *w, const struct measurement *m,
+		enum validation reason)
+{
+	struct writer_file *fw = (struct writer_file *) w;
+	assert(fw);
+	assert(m);
+	assert(HEADER_LEN + QUARANTINE_LEN <= sizeof(fw->block));
+
+	int64_t timestamp = timestamp_ms(&m->timestamp);
+	int32_t values[5] = {
+		reason, lround(m->power), lround(m->powerL1),
+		lround(m->powerL2), lround(m->powerL3)
+	};
+	double voltages[PHASES] = {m->voltageL1, m->voltageL2, m->voltageL3};
+
+	// a block with a single row
+	uint8_t *column = put_header(fw->block, MAGIC_QUARANTINE, 1);
+	column = put_column(column, &timestamp, sizeof(timestamp), 0, 1);
+	column = put_column(column, &values[0], sizeof(values[0]), 0, 1);
+	column = put_column(column, &m->energy_count, sizeof(m->energy_count),
+		0, 1);
+	for (unsigned j = 1; j < 5; j++) {
+		column = put_column(column, &values[j], sizeof(values[j]), 0, 1);
+	}
+	for (unsigned j = 0; j < PHASES; j++) {
+		column = put_column(column, &voltages[j], sizeof(voltages[j]),
+			0, 1);
+	}
+
+	return write_block(fw, fw->quarantine_fd, HEADER_LEN + QUARANTINE_LEN);
+}
+
+static bool
+file_update_current(struct writer *w, const struct current_values *values)
+{
+	struct writer_file *fw = (struct writer_file *) w;
+	assert(fw);
+	assert(values);
+	assert(values->measurement);
+
+	int64_t timestamp = timestamp_ms(&values->measurement->timestamp);
+	double record_values[4] = {
+		values->measurement->energy_count,
+		values->energy_daily ? *values->energy_daily : NAN,
+		values->cost_daily ? *values->cost_daily : NAN,
+		values->cost_monthly ? *values->cost_monthly : NAN,
+	};
+
+	uint8_t record[sizeof(timestamp) + sizeof(record_values)];
+	memcpy(record, &timestamp, sizeof(timestamp));
+	memcpy(record + sizeof(timestamp), record_values, sizeof(record_values));
+
+	if (fw->dry_run) {
+		return true;
+	}
+
+	ssize_t n = pwrite(fw->current_fd, record, sizeof(record), 0);
+	if (n < 0 || (size_t) n != sizeof(record)) {
+		fprintf(stderr, "Error: Writing to %s failed (%s)\n",
+			fw->dir, n < 0 ? strerror(errno) : "short write");
+		return false;
+	}
+	return true;
+}
+
+static bool
+file_dry_run(struct writer *w, bool enable)
+{
+	struct writer_file *fw = (struct writer_file *) w;
+	assert(fw);
+
+	fw->dry_run = enable;
+	return true;
+}
+
+static bool
+file_flush(struct writer *w)
+{
+	struct writer_file *fw = (struct writer_file *) w;
+	assert(fw);
+
+	if (fdatasync(fw->measurements_fd) < 0 ||
+			fdatasync(fw->events_fd) < 0 ||
+			fdatasync(fw->quarantine_fd) < 0) {
+		fprintf(stderr, "Error: fdatasync() in %s failed (%s)\n",
+			fw->dir, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void
+file_close(struct writer *w)
+{
+	struct writer_file *fw = (struct writer_file *) w;
+	if (fw == NULL) {
+		return;
+	}
+
+	int fds[] = {fw->measurements_fd, fw->events_fd, fw->quarantine_fd,
+		fw->current_fd};
+	for (unsigned i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		if (fds[i] >= 0 && close(fds[i]) < 0) {
+			fprintf(stderr, "Error: Closing a file in %s failed (%s)\n",
+				fw->dir, strerror(errno));
+		}
+	}
+	free(fw->dir);
+	free(fw);
+}
+
+static int
+open_file(const char *dir, const char *name, int flags)
+{
+	char path[PATH_MAX];
+	int len = snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (len < 0 || (size_t) len >= sizeof(path)) {
+		fprintf(stderr, "Error: Path %s/%s too long\n", dir, name);
+		return -1;
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | flags, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Opening %s failed (%s)\n",
+			path, strerror(errno));
+	}
+	return fd;
+}
+
+static const struct writer_ops file_ops = {
+	.name = "file",
+	.write = file_write,
+	.write_events = file_write_events,
+	.write_quarantine = file_write_quarantine,
+	.update_current = file_update_current,
+	.write_cost = NULL,
+	.read_counters = NULL,
+	.get_counter_at_start_of_day = NULL,
+	.flush = file_flush,
+	.dry_run = file_dry_run,
+	.close = file_close,
+};
+
+struct writer *
+writer_file_create(const char *dir)
+{
+	assert(dir);
+
+	struct writer_file *fw = calloc(1, sizeof(struct writer_file));
+	if (fw == NULL) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return NULL;
+	}
+	fw->writer.ops = &file_ops;
+	fw->measurements_fd = fw->events_fd = fw->quarantine_fd =
+		fw->current_fd = -1;
+
+	fw->dir = strdup(dir);
+	if (fw->dir == NULL) {
+		fprintf(stderr, "Error: strdup() failed (%s)\n",
+			strerror(errno));
+		file_close(&fw->writer);
+		return NULL;
+	}
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error: Creating %s failed (%s)\n",
+			dir, strerror(errno));
+		file_close(&fw->writer);
+		return NULL;
+	}
+
+	fw->measurements_fd = open_file(dir, "measurements.col", O_APPEND);
+	fw->events_fd = open_file(dir, "events.col", O_APPEND);
+	fw->quarantine_fd = open_file(dir, "quarantine.col", O_APPEND);
+	fw->current_fd = open_file(dir, "current", 0);
+	if (fw->measurements_fd < 0 || fw->events_fd < 0 ||
+			fw->quarantine_fd < 0 || fw->current_fd < 0) {
+		file_close(&fw->writer);
+		return NULL;
+	}
+
+	return &fw->writer;
+}
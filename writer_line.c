@@ -0,0 +1,279 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+// Storage backend which writes the measurements in the InfluxDB line protocol
+// to stdout or a Unix stream socket, e.g. to pipe them into another collector.
+// If the collector closes the socket, e.g. because it is restarted, the lines
+// are dropped until the connection is established again.
+
+#include "writer.h"
+#include <assert.h> // assert()
+#include <errno.h>
+#include <math.h> // lround()
+#include <stdbool.h>
+#include <stdio.h> // snprintf(), fprintf()
+#include <stdlib.h> // calloc(), free()
+#include <string.h> // strerror(), strlen()
+#include <sys/socket.h> // socket(), connect(), send()
+#include <sys/un.h> // struct sockaddr_un
+#include <time.h> // time()
+#include <unistd.h> // write(), close()
+
+// Maximal length of one line
+#define LINE_LEN 200
+
+// Minimal time between two attempts to connect to the collector again
+#define RECONNECT_INTERVAL 10 // s
+
+struct writer_line {
+	struct writer writer;
+	int fd; // -1 if the socket is disconnected
+	bool is_socket;
+	struct sockaddr_un addr;
+	unsigned long dropped; // lines dropped while disconnected
+	time_t last_attempt; // of a connect() while disconnected
+	bool dry_run; // the lines are formatted but not written
+	char buf[WRITER_BATCH_MAX * LINE_LEN];
+};
+
+// Returns a connected socket or -1, errno is set then
+static int
+line_connect(const struct sockaddr_un *addr)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) < 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+// Writes len bytes of buf, which contain the given number of lines. Only
+// errors of stdout are fatal, the lines for a socket are dropped instead.
+static bool
+write_all(struct writer_line *lw, size_t len, unsigned lines)
+{
+	if (lw->dry_run) {
+		return true;
+	}
+
+	if (lw->fd < 0) {
+		time_t now = time(NULL);
+		if (now - lw->last_attempt >= RECONNECT_INTERVAL) {
+			lw->last_attempt = now;
+			lw->fd = line_connect(&lw->addr);
+		}
+		if (lw->fd < 0) {
+			lw->dropped += lines;
+			return true;
+		}
+		fprintf(stderr, "Reconnected to %s, %lu lines were dropped\n",
+			lw->addr.sun_path, lw->dropped);
+		lw->dropped = 0;
+	}
+
+	size_t pos = 0;
+	while (pos < len) {
+		ssize_t n;
+		if (lw->is_socket) {
+			// don't raise SIGPIPE if the collector went away
+			n = send(lw->fd, lw->buf + pos, len - pos, MSG_NOSIGNAL);
+		} else {
+			n = write(lw->fd, lw->buf + pos, len - pos);
+		}
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error: Writing line protocol failed (%s)\n",
+				strerror(errno));
+			if (!lw->is_socket) {
+				return false;
+			}
+			fprintf(stderr, "Dropping lines until %s accepts "
+				"connections again\n", lw->addr.sun_path);
+			close(lw->fd);
+			lw->fd = -1;
+			lw->last_attempt = time(NULL);
+			lw->dropped += lines;
+			return true;
+		}
+		pos += n;
+	}
+	return true;
+}
+
+static bool
+line_write(struct writer *w, const struct measurement *m, unsigned n)
+{
+	struct writer_line *lw = (struct writer_line *) w;
+	assert(lw);
+	assert(m || n == 0);
+	assert(n <= WRITER_BATCH_MAX);
+
+	size_t pos = 0;
+	for (unsigned i = 0; i < n; i++) {
+		pos += snprintf(lw->buf + pos, sizeof(lw->buf) - pos,
+			"stromzaehler energy=%.7f,power_total=%ldi,"
+			"power_phase1=%ldi,power_phase2=%ldi,power_phase3=%ldi "
+			"%lld%09ld\n",
+			m[i].energy_count, lround(m[i].power),
+			lround(m[i].powerL1), lround(m[i].powerL2),
+			lround(m[i].powerL3),
+			(long long) m[i].timestamp.tv_sec,
+			m[i].timestamp.tv_nsec);
+		assert(pos < sizeof(lw->buf) && "line buffer too small");
+	}
+
+	return write_all(lw, pos, n);
+}
+
+static bool
+line_write_events(struct writer *w, const struct event *e, unsigned n)
+{
+	struct writer_line *lw = (struct writer_line *) w;
+	assert(lw);
+	assert(e || n == 0);
+
+	size_t pos = 0;
+	for (unsigned i = 0; i < n; i++) {
+		pos += snprintf(lw->buf + pos, sizeof(lw->buf) - pos,
+			"lastwechsel,phase=%u delta_power=%ldi,power=%ldi "
+			"%lld%09ld\n",
+			e[i].phase, lround(e[i].delta), lround(e[i].power),
+			(long long) e[i].timestamp.tv_sec,
+			e[i].timestamp.tv_nsec);
+		assert(pos < sizeof(lw->buf) && "line buffer too small");
+	}
+
+	return write_all(lw, pos, n);
+}
+
+static bool
+line_write_quarantine(struct writer *w, const struct measurement *m,
+		enum validation reason)
+{
+	struct writer_line *lw = (struct writer_line *) w;
+	assert(lw);
+	assert(m);
+
+	int len = snprintf(lw->buf, sizeof(lw->buf),
+		"quarantine reason=\"%s\",energy=%.7f,power_total=%ldi,"
+		"power_phase1=%ldi,power_phase2=%ldi,power_phase3=%ldi,"
+		"voltage_phase1=%.1f,voltage_phase2=%.1f,voltage_phase3=%.1f "
+		"%lld%09ld\n",
+		validation_name(reason), m->energy_count, lround(m->power),
+		lround(m->powerL1), lround(m->powerL2), lround(m->powerL3),
+		m->voltageL1, m->voltageL2, m->voltageL3,
+		(long long) m->timestamp.tv_sec, m->timestamp.tv_nsec);
+	assert((size_t) len < sizeof(lw->buf) && "line buffer too small");
+
+	return write_all(lw, len, 1);
+}
+
+static bool
+line_write_cost(struct writer *w, enum cost_period period,
+		const struct date *date, double cost)
+{
+	struct writer_line *lw = (struct writer_line *) w;
+	assert(lw);
+	assert(date);
+
+	struct date day = *date;
+	int len = snprintf(lw->buf, sizeof(lw->buf),
+		"kosten,period=%s cost=%.4f %lld000000000\n",
+		period == COST_DAY ? "day" : "month", cost,
+		(long long) date_to_time(&day));
+	assert((size_t) len < sizeof(lw->buf) && "line buffer too small");
+
+	return write_all(lw, len, 1);
+}
+
+static bool
+line_dry_run(struct writer *w, bool enable)
+{
+	struct writer_line *lw = (struct writer_line *) w;
+	assert(lw);
+
+	lw->dry_run = enable;
+	return true;
+}
+
+static bool
+line_flush(struct writer *w)
+{
+	// lines are written without buffering
+	(void) w;
+	return true;
+}
+
+static void
+line_close(struct writer *w)
+{
+	struct writer_line *lw = (struct writer_line *) w;
+	if (lw == NULL) {
+		return;
+	}
+
+	if (lw->is_socket && lw->fd >= 0 && close(lw->fd) < 0) {
+		fprintf(stderr, "Error: Closing socket failed (%s)\n",
+			strerror(errno));
+	}
+	free(lw);
+}
+
+static const struct writer_ops line_ops = {
+	.name = "line",
+	.write = line_write,
+	.write_events = line_write_events,
+	.write_quarantine = line_write_quarantine,
+	.update_current = NULL,
+	.write_cost = line_write_cost,
+	.read_counters = NULL,
+	.get_counter_at_start_of_day = NULL,
+	.flush = line_flush,
+	.dry_run = line_dry_run,
+	.close = line_close,
+};
+
+struct writer *
+writer_line_create(const char *path)
+{
+	struct writer_line *lw = calloc(1, sizeof(struct writer_line));
+	if (lw == NULL) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return NULL;
+	}
+	lw->writer.ops = &line_ops;
+
+	if (path == NULL) {
+		lw->fd = STDOUT_FILENO;
+		lw->is_socket = false;
+		return &lw->writer;
+	}
+
+	lw->addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(lw->addr.sun_path)) {
+		fprintf(stderr, "Error: Socket path %s too long\n", path);
+		free(lw);
+		return NULL;
+	}
+	strcpy(lw->addr.sun_path, path);
+
+	// the collector has to run at the start
+	lw->is_socket = true;
+	lw->fd = line_connect(&lw->addr);
+	if (lw->fd < 0) {
+		fprintf(stderr, "Error: Connecting to %s failed (%s)\n",
+			path, strerror(errno));
+		free(lw);
+		return NULL;
+	}
+
+	return &lw->writer;
+}
@@ -0,0 +1,457 @@
+// Copyright © 2021 Maximilian Wenzkowski
+
+#include "memory.h"
+#include "writer.h"
+#include <assert.h> // assert()
+#include <errno.h>
+#include <libpq-fe.h>
+#include <math.h> // lround()
+#include <stdbool.h>
+#include <stdio.h> // snprintf(), fprintf()
+#include <stdlib.h> // calloc(), free(), strtod()
+
+#define QUERY_BUF_LEN 512
+// Maximal length of one row in the VALUES list of an INSERT statement
+#define ROW_LEN 160
+
+struct writer_pg {
+	struct writer writer;
+	PGconn *conn;
+	char *query_buf;
+	size_t query_buf_len;
+	unsigned long errors; // failed statements, checked by the dry run
+};
+
+// PQexec() allocates every result, these allocations are counted separately
+static PGresult *
+pg_exec(struct writer_pg *pg, const char *query)
+{
+	memory_library_begin();
+	PGresult *res = PQexec(pg->conn, query);
+	memory_library_end();
+	return res;
+}
+
+// Executes a SQL command which doesn't return rows. Returns false if the
+// connection to the database is lost. executed is set to false if the command
+// failed otherwise.
+static bool
+exec_command_checked(struct writer_pg *pg, const char *query, bool *executed)
+{
+	assert(pg);
+	assert(query);
+	assert(executed);
+
+	*executed = false;
+
+	PGresult *res = pg_exec(pg, query);
+	if (res == NULL) {
+		fprintf(stderr, "PQexec failed: probably OOM\n");
+		return false;
+	}
+
+	bool ok = true;
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		fprintf(stderr, "PQexec failed: %s\n", PQerrorMessage(pg->conn));
+		pg->errors++;
+
+		if (PQstatus(pg->conn) == CONNECTION_BAD) {
+			fprintf(stderr, "Connection to database lost");
+			ok = false;
+		}
+	} else {
+		*executed = true;
+	}
+
+	PQclear(res);
+	return ok;
+}
+
+static bool
+exec_command(struct writer_pg *pg, const char *query)
+{
+	bool executed;
+	return exec_command_checked(pg, query, &executed);
+}
+
+// Formats one INSERT of n measurements into query_buf
+static void
+format_insert(struct writer_pg *pg, const struct measurement *m, unsigned n)
+{
+	size_t pos = snprintf(pg->query_buf, pg->query_buf_len,
+		"INSERT INTO stromzähler(timestamp, energy, power_total, "
+		"power_phase1, power_phase2, power_phase3) VALUES");
+
+	for (unsigned i = 0; i < n; i++) {
+		long long timestamp_sec = (long long) m[i].timestamp.tv_sec;
+		long timestamp_msec = m[i].timestamp.tv_nsec / 1000000;
+
+		pos += snprintf(pg->query_buf + pos, pg->query_buf_len - pos,
+			"%s(to_timestamp(%lld.%.3ld), %.7f, %ld, %ld, %ld, %ld)",
+			i == 0 ? "" : ",",
+			timestamp_sec, timestamp_msec,
+			m[i].energy_count, lround(m[i].power),
+			lround(m[i].powerL1), lround(m[i].powerL2),
+			lround(m[i].powerL3));
+		assert(pos < pg->query_buf_len && "query_buf too small");
+	}
+
+	pos += snprintf(pg->query_buf + pos, pg->query_buf_len - pos, ";");
+	assert(pos < pg->query_buf_len && "query_buf too small");
+}
+
+static bool
+pg_write(struct writer *w, const struct measurement *m, unsigned n)
+{
+	struct writer_pg *pg = (struct writer_pg *) w;
+	assert(pg);
+	assert(m || n == 0);
+	assert(n <= WRITER_BATCH_MAX);
+
+	if (n == 0) {
+		return true;
+	}
+
+	bool executed;
+	format_insert(pg, m, n);
+	if (!exec_command_checked(pg, pg->query_buf, &executed)) {
+		return false;
+	}
+	if (executed) {
+		return true;
+	}
+
+	// A single bad row fails the whole INSERT. Insert the rows one at a
+	// time, so only the bad rows are lost.
+	unsigned dropped = 0;
+	for (unsigned i = 0; i < n; i++) {
+		format_insert(pg, &m[i], 1);
+		if (!exec_command_checked(pg, pg->query_buf, &executed)) {
+			return false;
+		}
+		if (!executed) {
+			dropped++;
+		}
+	}
+	fprintf(stderr, "Error: %u of %u measurements couldn't be stored\n",
+		dropped, n);
+	return true;
+}
+
+static bool
+pg_write_events(struct writer *w, const struct event *e, unsigned n)
+{
+	struct writer_pg *pg = (struct writer_pg *) w;
+	assert(pg);
+	assert(e || n == 0);
+
+	for (unsigned i = 0; i < n; i++) {
+		long long timestamp_sec = (long long) e[i].timestamp.tv_sec;
+		long timestamp_msec = e[i].timestamp.tv_nsec / 1000000;
+
+		char query_buf[QUERY_BUF_LEN];
+
+		int len = snprintf(query_buf, QUERY_BUF_LEN,
+			"INSERT INTO lastwechsel(timestamp, phase, delta_power, power) "
+			"VALUES(to_timestamp(%lld.%.3ld), %u, %ld, %ld);",
+			timestamp_sec, timestamp_msec, e[i].phase,
+			lround(e[i].delta), lround(e[i].power));
+		assert(len < QUERY_BUF_LEN && "query_buf too small");
+
+		if (!exec_command(pg, query_buf)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool
+pg_write_quarantine(struct writer *w, const struct measurement *m,
+		enum validation reason)
+{
+	struct writer_pg *pg = (struct writer_pg *) w;
+	assert(pg);
+	assert(m);
+
+	char query_buf[QUERY_BUF_LEN];
+	int len = snprintf(query_buf, QUERY_BUF_LEN,
+		"INSERT INTO quarantine(timestamp, reason, energy, power_total, "
+		"power_phase1, power_phase2, power_phase3, voltage_phase1, "
+		"voltage_phase2, voltage_phase3) "
+		"VALUES(to_timestamp(%lld.%.3ld), '%s', %.7f, %ld, %ld, %ld, "
+		"%ld, %.1f, %.1f, %.1f);",
+		(long long) m->timestamp.tv_sec, m->timestamp.tv_nsec / 1000000,
+		validation_name(reason), m->energy_count, lround(m->power),
+		lround(m->powerL1), lround(m->powerL2), lround(m->powerL3),
+		m->voltageL1, m->voltageL2, m->voltageL3);
+	assert(len < QUERY_BUF_LEN && "query_buf too small");
+
+	return exec_command(pg, query_buf);
+}
+
+// Formats value for SQL, NULL if value is NULL
+static const char *
+sql_double(char *buf, size_t len, const double *value, int precision)
+{
+	if (value == NULL) {
+		return "NULL";
+	}
+	snprintf(buf, len, "%.*f", precision, *value);
+	return buf;
+}
+
+static bool
+pg_update_current(struct writer *w, const struct current_values *values)
+{
+	struct writer_pg *pg = (struct writer_pg *) w;
+	assert(pg);
+	assert(values);
+	assert(values->measurement);
+
+	char energy_daily[32], cost_daily[32], cost_monthly[32];
+	char costs[128] = "";
+	char query_buf[QUERY_BUF_LEN];
+
+	if (values->has_costs) {
+		snprintf(costs, sizeof(costs),
+			", cost_daily = %s, cost_monthly = %s",
+			sql_double(cost_daily, sizeof(cost_daily),
+				values->cost_daily, 4),
+			sql_double(cost_monthly, sizeof(cost_monthly),
+				values->cost_monthly, 4));
+	}
+
+	int len = snprintf(query_buf, QUERY_BUF_LEN,
+		"UPDATE current_values SET timestamp = CURRENT_TIMESTAMP, "
+		"energy = %.7f, energy_daily = %s%s WHERE id = 0;",
+		values->measurement->energy_count,
+		sql_double(energy_daily, sizeof(energy_daily),
+			values->energy_daily, 7),
+		costs);
+	assert(len < QUERY_BUF_LEN && "query_buf too small");
+
+	return exec_command(pg, query_buf);
+}
+
+static bool
+pg_write_cost(struct writer *w, enum cost_period period,
+		const struct date *date, double cost)
+{
+	struct writer_pg *pg = (struct writer_pg *) w;
+	assert(pg);
+	assert(date);
+
+	const char *table = period == COST_DAY ? "tageskosten" : "monatskosten";
+	char query_buf[QUERY_BUF_LEN];
+
+	// both statements are executed in one transaction
+	int len = snprintf(query_buf, QUERY_BUF_LEN,
+		"DELETE FROM %s WHERE date = '%04u-%02u-%02u'; "
+		"INSERT INTO %s(date, cost) VALUES('%04u-%02u-%02u', %.4f);",
+		table, date->year, date->month, date->day,
+		table, date->year, date->month, date->day, cost);
+	assert(len < QUERY_BUF_LEN && "query_buf too small");
+
+	return exec_command(pg, query_buf);
+}
+
+static bool
+pg_read_counters(struct writer *w, time_t from, time_t to,
+		counter_callback callback, void *ctx)
+{
+	struct writer_pg *pg = (struct writer_pg *) w;
+	assert(pg);
+	assert(callback);
+
+	char query_buf[QUERY_BUF_LEN];
+
+	// only the last value of each minute is transferred
+	int len = snprintf(query_buf, QUERY_BUF_LEN,
+		"SELECT extract(epoch FROM date_trunc('minute', timestamp))::bigint, "
+		"max(energy) FROM stromzähler "
+		"WHERE timestamp >= to_timestamp(%lld) "
+		"AND timestamp < to_timestamp(%lld) "
+		"GROUP BY 1 ORDER BY 1;",
+		(long long) from, (long long) to);
+	assert(len < QUERY_BUF_LEN && "query_buf too small");
+
+	PGresult *res = pg_exec(pg, query_buf);
+	if (res == NULL) {
+		fprintf(stderr, "PQexec failed: probably OOM\n");
+		return false;
+	}
+
+	bool ok = true;
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		fprintf(stderr, "PQexec failed: %s\n", PQerrorMessage(pg->conn));
+		pg->errors++;
+		ok = false;
+	} else {
+		int rows = PQntuples(res);
+		for (int i = 0; i < rows && ok; i++) {
+			time_t time = strtoll(PQgetvalue(res, i, 0), NULL, 10);
+			double counter = strtod(PQgetvalue(res, i, 1), NULL);
+			ok = callback(ctx, time, counter);
+		}
+	}
+
+	PQclear(res);
+	return ok;
+}
+
+static bool
+pg_get_counter_at_start_of_day(struct writer *w, const struct date *date,
+		bool *found, double *counter)
+{
+	struct writer_pg *pg = (struct writer_pg *) w;
+	assert(pg);
+	assert(date);
+	assert(found);
+	assert(counter);
+
+	*found = false;
+
+	char query_buf[QUERY_BUF_LEN];
+
+	struct date current = *date;
+	struct date prev;
+	get_previous_date(&current, &prev);
+
+	int len = snprintf(query_buf, QUERY_BUF_LEN,
+		"SELECT energy FROM stromzähler "
+		"WHERE timestamp >= '%04d-%02d-%02d 23:59:00' "
+		"AND timestamp < '%04d-%02d-%02d' "
+		"ORDER BY timestamp DESC LIMIT 1;",
+		prev.year, prev.month, prev.day,
+		current.year, current.month, current.day);
+
+	assert(len < QUERY_BUF_LEN && "query_buf too small");
+
+	PGresult *res = pg_exec(pg, query_buf);
+	if (res == NULL) {
+		fprintf(stderr, "PQexec failed: probably OOM\n");
+		return false;
+	}
+
+	bool ok = true;
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		fprintf(stderr, "PQexec failed: %s\n", PQerrorMessage(pg->conn));
+		pg->errors++;
+
+		if (PQstatus(pg->conn) == CONNECTION_BAD) {
+			fprintf(stderr, "Connection to database lost");
+			ok = false;
+		}
+	} else if (PQntuples(res) > 0) {
+		char *start = PQgetvalue(res, 0, 0);
+		char *end = NULL;
+		errno = 0;
+		*counter = strtod(start, &end);
+		if (start != end && errno == 0) {
+			*found = true;
+		}
+	}
+
+	PQclear(res);
+	return ok;
+}
+
+// The statements of a dry run are executed in a transaction which is rolled
+// back at the end. Since it checks the database schema as well, the dry run
+// fails if any statement failed, e.g. because a table is missing.
+static bool
+pg_dry_run(struct writer *w, bool enable)
+{
+	struct writer_pg *pg = (struct writer_pg *) w;
+	assert(pg);
+
+	if (enable) {
+		pg->errors = 0;
+		return exec_command(pg, "BEGIN;");
+	}
+
+	unsigned long errors = pg->errors;
+	if (!exec_command(pg, "ROLLBACK;")) {
+		return false;
+	}
+	if (errors > 0) {
+		fprintf(stderr, "Error: %lu statements of the dry run failed\n",
+			errors);
+		return false;
+	}
+	return true;
+}
+
+static bool
+pg_flush(struct writer *w)
+{
+	// every statement is committed immediately
+	(void) w;
+	return true;
+}
+
+static void
+pg_close(struct writer *w)
+{
+	struct writer_pg *pg = (struct writer_pg *) w;
+	if (pg == NULL) {
+		return;
+	}
+
+	if (pg->conn) {
+		PQfinish(pg->conn);
+	}
+	free(pg->query_buf);
+	free(pg);
+}
+
+static const struct writer_ops pg_ops = {
+	.name = "postgresql",
+	.write = pg_write,
+	.write_events = pg_write_events,
+	.write_quarantine = pg_write_quarantine,
+	.update_current = pg_update_current,
+	.write_cost = pg_write_cost,
+	.read_counters = pg_read_counters,
+	.get_counter_at_start_of_day = pg_get_counter_at_start_of_day,
+	.flush = pg_flush,
+	.dry_run = pg_dry_run,
+	.close = pg_close,
+};
+
+struct writer *
+writer_pg_create(const char *conninfo)
+{
+	assert(conninfo);
+
+	struct writer_pg *pg = calloc(1, sizeof(struct writer_pg));
+	if (pg == NULL) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		return NULL;
+	}
+	pg->writer.ops = &pg_ops;
+
+	pg->query_buf_len = QUERY_BUF_LEN + WRITER_BATCH_MAX * ROW_LEN;
+	pg->query_buf = malloc(pg->query_buf_len);
+	if (pg->query_buf == NULL) {
+		fprintf(stderr, "Error: Out of memory.\n");
+		pg_close(&pg->writer);
+		return NULL;
+	}
+
+	pg->conn = PQconnectdb(conninfo);
+	if (pg->conn == NULL) {
+		fprintf(stderr, "PQconnectdb() failed");
+		pg_close(&pg->writer);
+		return NULL;
+	}
+	if (PQstatus(pg->conn) == CONNECTION_BAD) {
+		fprintf(stderr, "Connection to database failed: %s\n",
+			PQerrorMessage(pg->conn));
+		pg_close(&pg->writer);
+		return NULL;
+	}
+
+	return &pg->writer;
+}